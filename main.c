@@ -1,12 +1,24 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/file.h>
 
 // 输入存放的位置
 struct InputBuffer_t {
@@ -51,10 +63,88 @@ struct Row_t {
 };
 typedef struct Row_t Row;
 
+// 表中的列
+enum Column_t {
+    COLUMN_ID,
+    COLUMN_USERNAME,
+    COLUMN_EMAIL
+};
+typedef enum Column_t Column;
+#define NUM_COLUMNS 3
+
+// where 子句中的比较运算符，字符串只支持等于和不等于
+enum CompareOp_t {
+    COMPARE_EQUAL,
+    COMPARE_NOT_EQUAL,
+    COMPARE_LESS,
+    COMPARE_LESS_EQUAL,
+    COMPARE_GREATER,
+    COMPARE_GREATER_EQUAL,
+    COMPARE_LIKE
+};
+typedef enum CompareOp_t CompareOp;
+
+/* like 的模式按形状分类，常见的几种不需要通用的匹配 */
+enum LikeKind_t {
+    LIKE_EXACT,
+    LIKE_PREFIX,
+    LIKE_SUFFIX,
+    LIKE_CONTAINS,
+    LIKE_GENERAL
+};
+typedef enum LikeKind_t LikeKind;
+
+// where 子句中的条件，直接在页面中的原始字节上求值
+struct Predicate_t {
+    bool enabled;
+    Column column;
+    CompareOp op;
+    uint32_t id;
+    char string[COLUMN_EMAIL_SIZE + 1];
+    // like 的模式中去掉两端的 % 之后的部分为 string[like_offset, like_offset + like_length)
+    LikeKind like_kind;
+    uint32_t like_offset;
+    uint32_t like_length;
+};
+typedef struct Predicate_t Predicate;
+
+#define MAX_AGGREGATES 8
+
+enum AggregateFunction_t {
+    AGGREGATE_COUNT,
+    AGGREGATE_MIN,
+    AGGREGATE_MAX
+};
+typedef enum AggregateFunction_t AggregateFunction;
+
+// select 中的聚合函数：count(*)、min(列)、max(列)
+struct Aggregate_t {
+    AggregateFunction function;
+    Column column;
+};
+typedef struct Aggregate_t Aggregate;
+
 // 声明，包括声明的类型和记录
 struct Statement_t {
     StatementType type;
     Row row_to_insert;
+    // select 输出的列，以及过滤条件
+    Column columns[NUM_COLUMNS];
+    uint32_t num_columns;
+    Predicate where;
+    // 聚合函数和 group by 的列，有任意一个时按分组输出
+    Aggregate aggregates[MAX_AGGREGATES];
+    uint32_t num_aggregates;
+    bool has_group_by;
+    Column group_by;
+    // order by 的列和 limit 的行数
+    bool has_order_by;
+    Column order_by;
+    bool has_limit;
+    uint64_t limit;
+    // explain analyze 前缀，执行时输出这条语句的执行轨迹
+    bool explain;
+    double parse_ms;
 };
 typedef struct Statement_t Statement;
 
@@ -78,16 +168,24 @@ uint32_t ROW_SIZE = 0;
 #define PAGE_SIZE 4096
 #define TABLE_MAX_PAGES 100
 
+/* 扫描时缺页一次最多预读的连续页面数，以及写回时一次 pwritev 最多合并的页面数，
+ * 都不能超过 IOV_MAX */
+#define PAGER_READ_AHEAD_PAGES 16
+#define PAGER_WRITE_BATCH_PAGES 64
+
+/* 使用大页时页框区的大小按 2MB 对齐 */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
 /* B 树内部节点头部布局
  * NODE_TYPE_SIZE          节点类型       1
  * IS_ROOT_SIZE            是否为根节点   1
- * PARENT_POINTER_SIZE     指向父亲的指针 4
+ * PARENT_POINTER_SIZE     指向父亲的指针 8
  * */
 uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
 uint32_t NODE_TYPE_OFFSET = 0;
 uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
 uint32_t IS_ROOT_OFFSET = 0;
-uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
+uint32_t PARENT_POINTER_SIZE = sizeof(uint64_t);
 uint32_t PARENT_POINTER_OFFSET = 0;
 uint8_t  COMMON_NODE_HEADER_SIZE = 0;
 
@@ -96,7 +194,7 @@ uint8_t  COMMON_NODE_HEADER_SIZE = 0;
  */
 uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
 uint32_t LEAF_NODE_NUM_CELLS_OFFSET = 0;
-uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
+uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint64_t);
 uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = 0;
 uint32_t LEAF_NODE_HEADER_SIZE = 0;
 
@@ -119,41 +217,529 @@ uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = 0;
 
 uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
 uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = 0;
-uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
+uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint64_t);
 uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET = 0;
 uint32_t INTERNAL_NODE_HEADER_SIZE = 0;
 
 /* B 树内部节点体布局 */
 uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
-uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
+uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint64_t);
 uint32_t INTERNAL_NODE_CELL_SIZE = 0;
+uint32_t INTERNAL_NODE_SPACE_FOR_CELLS = 0;
+uint32_t INTERNAL_NODE_MAX_CELLS = 0;
+
+/* 文件头布局，位于 0 号页面，根节点从 1 号页面开始
+ * MAGIC           文件标识       8
+ * VERSION         格式版本       4
+ * PAGE_SIZE       页面大小       4
+ * ROOT_PAGE_NUM   根节点的页号   8
+ */
+#define DB_FILE_MAGIC "SimpleDB"
+#define DB_FORMAT_VERSION 2
+uint32_t HEADER_MAGIC_SIZE = 8;
+uint32_t HEADER_MAGIC_OFFSET = 0;
+uint32_t HEADER_VERSION_SIZE = sizeof(uint32_t);
+uint32_t HEADER_VERSION_OFFSET = 0;
+uint32_t HEADER_PAGE_SIZE_SIZE = sizeof(uint32_t);
+uint32_t HEADER_PAGE_SIZE_OFFSET = 0;
+uint32_t HEADER_ROOT_PAGE_NUM_OFFSET = 0;
+
+/* 旧格式（版本 1）的文件没有文件头，页号为 4 字节，根节点在 0 号页面。
+ * 打开时会被转换为当前格式，这里只需要读取叶子所用到的偏移。 */
+#define LEGACY_NODE_NUM_CELLS_OFFSET 6
+#define LEGACY_LEAF_NODE_NEXT_LEAF_OFFSET 10
+#define LEGACY_LEAF_NODE_HEADER_SIZE 14
+#define LEGACY_INTERNAL_NODE_RIGHT_CHILD_OFFSET 10
+#define LEGACY_INTERNAL_NODE_HEADER_SIZE 14
+
+/* 写时复制（影子页面）模式的文件：0 号和 1 号页面是两个轮流写入的元页面，
+ * 其余页面存放数据。B 树仍然使用逻辑页号，元页面记录逻辑页号到文件中页号的映射。
+ * MAGIC           文件标识             8
+ * VERSION         格式版本             4
+ * PAGE_SIZE       页面大小             4
+ * TXN_ID          提交的编号           8
+ * NUM_PAGES       逻辑页面数           8
+ * CHECKSUM        元页面的校验和       8
+ * PAGE_MAP        每个逻辑页面在文件中的页号，8 字节，0 表示还没有写入
+ */
+#define COW_FILE_MAGIC "SDBShadw"
+#define COW_FORMAT_VERSION 1
+#define COW_META_PAGES 2
+#define COW_META_TXN_ID_OFFSET 16
+#define COW_META_NUM_PAGES_OFFSET 24
+#define COW_META_CHECKSUM_OFFSET 32
+#define COW_META_PAGE_MAP_OFFSET 40
+#define COW_PAGE_NONE 0
+/* 同时打开一个文件的进程数的上限 */
+#define COW_MAX_READERS 8
+// 新的页面不能覆盖上一次提交以及任何读者仍在使用的页面，文件最多需要这么多页
+#define COW_MAX_FILE_PAGES (COW_META_PAGES + (COW_MAX_READERS + 2) * TABLE_MAX_PAGES)
+#define COW_LOCK_FILE_SUFFIX ".lock"
+
+/*
+ * 写时复制模式的读者表，保存在 <文件名>.lock 中，所有进程以 MAP_SHARED 映射同一份。
+ * 每个打开文件的进程占一个槽位，记录它正在读取的版本的页面映射，提交时不会覆盖这些页面，
+ * 因此读取时不需要加锁。登记槽位、开始写入到提交结束都持有这个文件的 flock，写者之间互斥。
+ */
+struct CowReader_t {
+    // 为 0 表示空闲，进程已经退出的槽位在下一次加锁时回收
+    int32_t pid;
+    uint32_t padding;
+    uint64_t txn_id;
+    uint64_t num_pages;
+    uint64_t page_map[TABLE_MAX_PAGES];
+};
+typedef struct CowReader_t CowReader;
+
+struct CowReaderTable_t {
+    CowReader readers[COW_MAX_READERS];
+};
+typedef struct CowReaderTable_t CowReaderTable;
+
+/* .vacuum 默认的叶子填充率（百分比） */
+#define VACUUM_DEFAULT_FILL_FACTOR 100
+
+// 页面缓存的选项，由命令行参数设置
+struct PagerConfig_t {
+    // 页框区优先使用大页
+    bool huge_pages;
+    // 使用 O_DIRECT 打开文件，读写不经过操作系统的缓存
+    bool direct_io;
+    // 新建的文件使用写时复制模式
+    bool cow;
+    // 新建的表使用 LSM 引擎
+    bool lsm;
+};
+typedef struct PagerConfig_t PagerConfig;
+
+PagerConfig pager_config = { false, false, false, false };
 
 // 数据库文件，包括所有的页面
 struct Pager_t {
     int file_descriptor;
-    uint32_t file_length;
+    uint64_t file_length;
     // 记录目前页面的总数。
-    uint32_t num_pages;
+    uint64_t num_pages;
     void *pages[TABLE_MAX_PAGES];
+    // 一次性分配、按页对齐的页框区，pages 中的页面都来自这里
+    void *frames;
+    size_t frames_size;
+    // 空闲页框的编号
+    uint32_t free_frames[TABLE_MAX_PAGES];
+    uint32_t num_free_frames;
+
+    /* 写时复制模式。修改过的页面提交时写到新的位置，再写入另一个元页面发布新的映射，
+     * 因此文件中始终有一个完整的、一致的版本，崩溃后直接使用最新的有效元页面。 */
+    bool cow;
+    uint64_t txn_id;
+    // 最近一次提交写入的元页面
+    uint32_t meta_slot;
+    uint64_t page_map[TABLE_MAX_PAGES];
+    // 页面读入或提交时内容的指纹，提交时据此找出修改过的页面
+    uint64_t page_fingerprints[TABLE_MAX_PAGES];
+    // 读者表和其中属于这个 pager 的槽位，write_locked 表示正在写入，持有写锁
+    int lock_fd;
+    CowReaderTable *readers;
+    uint32_t reader_slot;
+    bool write_locked;
 };
 typedef struct Pager_t Pager;
 
+/* 自适应哈希索引的默认容量，以及叶子被点查多少次之后加入索引 */
+#define HASH_INDEX_DEFAULT_MAX_ENTRIES 4096
+#define HASH_INDEX_HOT_LOOKUPS 4
+
+// 自适应哈希索引中的一项，记录 id 所在的叶子和 cell
+struct HashIndexEntry_t {
+    bool used;
+    uint32_t key;
+    uint32_t cell_num;
+    uint64_t page_num;
+    // 加入索引时叶子的版本，与叶子当前的版本不同时这一项已经失效
+    uint32_t page_version;
+};
+typedef struct HashIndexEntry_t HashIndexEntry;
+
+// 只存在于内存中的自适应哈希索引，为经常被点查的叶子建立 id 到 (页面, cell) 的映射
+struct HashIndex_t {
+    HashIndexEntry *entries;
+    // 槽的个数，为 2 的幂，至少是 max_entries 的两倍
+    uint32_t capacity;
+    uint32_t max_entries;
+    uint32_t num_entries;
+    // 每个叶子被点查的次数
+    uint32_t lookups[TABLE_MAX_PAGES];
+    // 叶子每被修改一次版本加一
+    uint32_t page_versions[TABLE_MAX_PAGES];
+    bool page_indexed[TABLE_MAX_PAGES];
+    uint32_t hits;
+    uint32_t misses;
+};
+typedef struct HashIndex_t HashIndex;
+
+/* 分区表的目录文件，每个分区是一个独立的数据库文件 <filename>.p<i>
+ * MAGIC            文件标识       8
+ * VERSION          格式版本       4
+ * NUM_PARTITIONS   分区个数       4
+ * LOWER_BOUNDS     每个分区 id 的下界（包含），每个 4 字节，第一个分区的下界为 0
+ */
+#define CATALOG_FILE_MAGIC "SDBParts"
+#define CATALOG_FORMAT_VERSION 1
+#define CATALOG_HEADER_SIZE 16
+#define MAX_PARTITIONS 64
+/* 并行扫描时每个分区的输出缓冲区。缓冲区满了时扫描线程等待主线程输出，内存不随结果的大小增长 */
+#define PARTITION_OUTPUT_BUFFER_SIZE (64 * 1024)
+
+/* LSM 引擎：新的记录先放入内存中的 memtable，写满之后顺序写成一个不可修改的有序文件（run），
+ * 后台线程按层合并这些文件。表的文件名对应的文件是清单，记录当前有哪些 run：
+ * MAGIC        文件标识       8
+ * VERSION      格式版本       4
+ * NUM_RUNS     run 的个数     4
+ * NEXT_RUN_ID  下一个编号     8
+ * RUNS         每个 run 的编号（8 字节）和所在的层（4 字节，另有 4 字节填充）
+ * 每个 run 是一个文件 <filename>.r<id>：
+ * 0 号页面为文件头，之后每页存放 ROWS_PER_BLOCK 条按 id 排序的记录，
+ * 最后是稀疏索引（每页第一条记录的 id，4 字节）和布隆过滤器
+ */
+#define LSM_FILE_MAGIC "SDBLsmMf"
+#define LSM_RUN_MAGIC "SDBLsmRn"
+#define LSM_FORMAT_VERSION 1
+#define LSM_MANIFEST_HEADER_SIZE 24
+#define LSM_MANIFEST_RUN_SIZE 16
+#define LSM_RUN_ROWS_PER_BLOCK_OFFSET 12
+#define LSM_RUN_NUM_ROWS_OFFSET 16
+#define LSM_RUN_NUM_BLOCKS_OFFSET 24
+#define LSM_RUN_BLOOM_BYTES_OFFSET 32
+#define LSM_RUN_MIN_KEY_OFFSET 40
+#define LSM_RUN_MAX_KEY_OFFSET 44
+// memtable 的容量，写满之后写成 L0 的 run
+#define LSM_MEMTABLE_ROWS 4096
+// L0 的 run 达到这个个数时合并到 L1，达到 LSM_L0_STALL_RUNS 时插入等待合并
+#define LSM_L0_MAX_RUNS 4
+#define LSM_L0_STALL_RUNS 8
+// L1 及以下每层只有一个 run，Li 超过 LSM_LEVEL_BASE_ROWS * LSM_LEVEL_RATIO^(i-1) 条记录时合并到下一层
+#define LSM_MAX_LEVELS 8
+#define LSM_LEVEL_BASE_ROWS (LSM_MEMTABLE_ROWS * LSM_L0_MAX_RUNS)
+#define LSM_LEVEL_RATIO 10
+#define LSM_MAX_RUNS (LSM_L0_STALL_RUNS + LSM_MAX_LEVELS)
+#define LSM_BLOOM_BITS_PER_KEY 10
+#define LSM_BLOOM_HASHES 7
+#define LSM_WRITE_BUFFER_SIZE (1 << 20)
+
+// 一个不可修改的有序文件，索引和布隆过滤器常驻内存
+struct LsmRun_t {
+    uint64_t id;
+    uint32_t level;
+    char *filename;
+    int file_descriptor;
+    uint32_t rows_per_block;
+    uint64_t num_rows;
+    uint64_t num_blocks;
+    uint32_t min_key;
+    uint32_t max_key;
+    uint32_t *block_keys;
+    uint8_t *bloom;
+    uint64_t bloom_bits;
+    // 清单和正在扫描它的语句各持有一个引用，被合并掉之后引用为 0 时删除文件
+    uint32_t refs;
+    bool obsolete;
+};
+typedef struct LsmRun_t LsmRun;
+
+struct LsmTree_t {
+    char *filename;
+    // 只有执行语句的线程访问 memtable。按插入的顺序存放，扫描前按需排序
+    uint8_t *memtable;
+    uint32_t memtable_rows;
+    bool memtable_sorted;
+    // memtable 中 id 的集合，用于检查重复的键，存放 id + 1，0 表示空槽
+    uint32_t *memtable_keys;
+    // L0 在前（新的在前），之后是 L1、L2……，由 mutex 保护
+    LsmRun *runs[LSM_MAX_RUNS];
+    uint32_t num_runs;
+    uint64_t next_run_id;
+    uint64_t compactions;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    pthread_t compactor;
+    bool stopping;
+};
+typedef struct LsmTree_t LsmTree;
+
+// 顺序写一个新的 run
+struct LsmRunWriter_t {
+    LsmTree *lsm;
+    uint64_t id;
+    uint32_t level;
+    char *filename;
+    FILE *stream;
+    uint32_t rows_per_block;
+    uint64_t num_rows;
+    uint8_t *block;
+    uint32_t block_rows;
+    uint32_t *block_keys;
+    uint64_t num_blocks;
+    uint8_t *bloom;
+    uint64_t bloom_bits;
+    uint32_t min_key;
+    uint32_t max_key;
+};
+typedef struct LsmRunWriter_t LsmRunWriter;
+
+// 按 id 的顺序读取 memtable 或者一个 run，多个来源归并后就是整个表
+struct LsmSource_t {
+    // 为空表示 memtable
+    LsmRun *run;
+    uint8_t *rows;
+    uint64_t position;
+    uint64_t num_rows;
+    uint64_t loaded_block;
+};
+typedef struct LsmSource_t LsmSource;
+
 // 表格
 struct Table_t {
     Pager *pager;
-    uint32_t root_page_num;
+    uint64_t root_page_num;
+    // 数据库文件名，.vacuum 重建文件后需要替换它
+    char *filename;
+    // 最近一次插入所在的叶子，键落在它的范围内时插入不必从根节点下降
+    bool has_last_leaf;
+    uint64_t last_leaf_page_num;
+    // 为空表示不使用自适应哈希索引
+    HashIndex *hash_index;
+    // 分区表没有自己的 pager，每个分区是一个独立的表。普通的表 num_partitions 为 0
+    uint32_t num_partitions;
+    uint32_t partition_lower_bounds[MAX_PARTITIONS];
+    struct Table_t *partitions[MAX_PARTITIONS];
+    // 使用 LSM 引擎的表没有 pager，普通的表为空
+    LsmTree *lsm;
 };
 typedef struct Table_t Table;
 
+/* order by 使用的内存上限，超过之后把排好序的一段写入临时文件，最后多路归并。
+ * 归并时每一段的读缓冲区最多 SORT_RUN_BUFFER_SIZE，段数超过内存能容纳的路数时分多趟归并。 */
+#define SORT_MEMORY_BUDGET (4 * 1024 * 1024)
+#define SORT_RUN_BUFFER_SIZE (64 * 1024)
+/* 两路归并需要两个读缓冲区、两行当前记录和一个写缓冲区，每个至少一行 */
+#define SORT_MIN_MERGE_ROWS 5
+/* 路数多时缩小读缓冲区以减少归并的趟数，但不小于这个大小 */
+#define SORT_MIN_BUFFER_SIZE 4096
+/* 一次 pwritev 最多写入的行数 */
+#define SORT_WRITE_BATCH_ROWS 256
+
+// 可以用 .sort_memory <kb> 修改
+uint64_t sort_memory_budget = SORT_MEMORY_BUDGET;
+
+// 临时文件中的一个有序段
+struct SortRun_t {
+    uint64_t offset;
+    uint64_t num_rows;
+};
+typedef struct SortRun_t SortRun;
+
+// 排序的一项。prefix 是排序列的前 8 个字节，大多数比较不需要访问记录
+struct SortEntry_t {
+    uint64_t prefix;
+    void *row;
+};
+typedef struct SortEntry_t SortEntry;
+
+struct Sorter_t {
+    uint32_t offset;
+    uint32_t size;
+    // 只需要前 limit 行时用大小为 limit 的堆，不需要写临时文件
+    bool top_n;
+    uint8_t *rows;
+    SortEntry *entries;
+    uint32_t num_rows;
+    uint32_t max_rows;
+    // 有序段都写在同一个临时文件中，多趟归并时在两个临时文件之间交替，文件描述符的个数不随段数增长
+    FILE *files[2];
+    uint64_t file_ends[2];
+    uint32_t current_file;
+    SortRun *runs;
+    uint32_t num_runs;
+};
+typedef struct Sorter_t Sorter;
+
+// 归并时一个有序段的读取状态，buffer 来自 Sorter 的 rows
+struct SortRunReader_t {
+    SortRun run;
+    uint64_t rows_read;
+    uint8_t *buffer;
+    uint32_t buffered;
+    uint32_t position;
+};
+typedef struct SortRunReader_t SortRunReader;
+
+/* 向量化执行时一批最多的记录数 */
+#define VECTOR_BATCH_SIZE 1024
+
+// 一个聚合函数的当前结果
+struct AggregateValue_t {
+    bool has_value;
+    uint32_t id;
+    char *string;
+};
+typedef struct AggregateValue_t AggregateValue;
+
+// 一个分组，没有 group by 时只有一个分组
+struct AggregateGroup_t {
+    bool used;
+    char *key;
+    uint64_t count;
+    AggregateValue values[MAX_AGGREGATES];
+};
+typedef struct AggregateGroup_t AggregateGroup;
+
+// 哈希聚合，分组用开放定址的哈希表保存
+struct Aggregator_t {
+    Aggregate *aggregates;
+    uint32_t num_aggregates;
+    bool has_group_by;
+    uint32_t group_offset;
+    uint32_t group_size;
+    AggregateGroup *groups;
+    uint32_t capacity;
+    uint32_t num_groups;
+};
+typedef struct Aggregator_t Aggregator;
+
+// 扫描输出的记录交给 RowSink：直接输出，或者先交给 Sorter 排序、Aggregator 聚合
+struct RowSink_t {
+    FILE *out;
+    Column *columns;
+    uint32_t num_columns;
+    bool has_limit;
+    uint64_t remaining;
+    Sorter *sorter;
+    Aggregator *aggregator;
+};
+typedef struct RowSink_t RowSink;
+
+// 并行扫描一个分区，输出写入有界的缓冲区，主线程按分区的顺序取出并输出
+struct PartitionScan_t {
+    Statement *statement;
+    Table *table;
+    pthread_t thread;
+    char *buffer;
+    size_t length;
+    // 扫描已经结束，缓冲区中剩下的就是全部输出
+    bool finished;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+};
+typedef struct PartitionScan_t PartitionScan;
+
 // 游标
 struct Cursor_t {
     Table* table;
-    uint32_t page_num;
+    uint64_t page_num;
     uint32_t cell_num;
     bool end_of_table;
 };
 typedef struct Cursor_t Cursor;
 
+// 按键的顺序把 cell 写入新文件，构建一棵紧凑的树
+struct TreeBuilder_t {
+    Pager *pager;
+    uint32_t cells_per_leaf;
+    uint64_t num_leaves;
+    uint64_t first_leaf;
+    // 正在填充的叶子
+    uint64_t leaf;
+};
+typedef struct TreeBuilder_t TreeBuilder;
+
+// explain analyze 统计耗时的阶段
+enum QueryPhase_t {
+    PHASE_NONE,
+    PHASE_PARSE,
+    PHASE_SEEK,
+    PHASE_SCAN,
+    PHASE_OUTPUT,
+    PHASE_COUNT
+};
+typedef enum QueryPhase_t QueryPhase;
+
+// 单条语句的执行轨迹，只有 explain analyze 时才会记录
+struct QueryTrace_t {
+    uint32_t pages_touched;
+    uint32_t cache_misses;
+    // 下标为页面编号，get_page 允许访问到 TABLE_MAX_PAGES
+    bool page_touched[TABLE_MAX_PAGES + 1];
+    bool page_missed[TABLE_MAX_PAGES + 1];
+    uint32_t nodes_visited;
+    uint32_t leaves_walked;
+    uint32_t rows_examined;
+    uint32_t rows_returned;
+    uint32_t splits;
+    // 读文件的系统调用次数，以及读入的页面数
+    uint32_t read_calls;
+    uint32_t pages_read;
+    uint32_t hash_index_hits;
+    uint32_t sort_runs;
+    uint32_t sort_merge_passes;
+    double phase_ms[PHASE_COUNT];
+    QueryPhase phase;
+    struct timespec phase_start;
+};
+typedef struct QueryTrace_t QueryTrace;
+
+// 正在执行 explain analyze 的语句的轨迹，为空表示不记录
+QueryTrace *active_trace = NULL;
+
+/* 批处理模式：解析线程提前解析后面的语句，主线程执行当前的语句。
+ * 两个线程之间传递的单位是一组语句，减少加锁的次数。 */
+#define BATCH_CHUNK_SIZE 256
+#define BATCH_QUEUE_CHUNKS 4
+#define BATCH_STDIN_BUFFER_SIZE (1 << 20)
+
+// 解析好的一行输入，元命令和无法识别的语句保留原始的文本
+struct BatchItem_t {
+    bool meta_command;
+    PrepareResult result;
+    Statement statement;
+    char *line;
+};
+typedef struct BatchItem_t BatchItem;
+
+struct BatchChunk_t {
+    BatchItem items[BATCH_CHUNK_SIZE];
+    uint32_t num_items;
+    // 输入已经结束，这是最后一组
+    bool last;
+};
+typedef struct BatchChunk_t BatchChunk;
+
+struct BatchQueue_t {
+    BatchChunk chunks[BATCH_QUEUE_CHUNKS];
+    uint32_t head;
+    uint32_t count;
+    // 主线程不再需要后面的语句（.exit）
+    bool stopped;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_t parser;
+
+    // 普通文件整个映射到内存中，否则（标准输入、管道）用 read 读入缓冲区 [buffer_start, buffer_end)
+    char *data;
+    size_t size;
+    size_t offset;
+    int stream_fd;
+    char *buffer;
+    size_t buffer_size;
+    size_t buffer_start;
+    size_t buffer_end;
+    bool eof;
+    // 主线程停止时写入，唤醒等待输入的解析线程
+    int wake_pipe[2];
+    size_t bytes_read;
+};
+typedef struct BatchQueue_t BatchQueue;
+
 // 节点类型
 enum NodeType_t {
     NODE_INTERNAL,
@@ -165,6 +751,8 @@ void initialize();
 InputBuffer *new_input_buffer(void);
 void print_prompt(void);
 void read_input(InputBuffer *input_buffer);
+void print_prepare_error(PrepareResult result, InputBuffer *input_buffer);
+void print_execute_error(ExecuteResult result);
 MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table);
 PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement);
 ExecuteResult execute_statement(Statement *statement, Table *table);
@@ -175,14 +763,88 @@ void *cursor_value(Cursor *cursor);
 ExecuteResult execute_insert(Statement *statement, Table *table);
 ExecuteResult execute_select(Statement *statement, Table *table);
 PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement);
-void *get_page(Pager* pager, uint32_t page_num);
-Pager* pager_open(const char *filename);
+PrepareResult prepare_select(InputBuffer *input_buffer, Statement *statement);
+PrepareResult prepare_where(Predicate *where, char **saveptr);
+bool parse_column(const char *name, Column *column);
+char *strip_quotes(char *token);
+
+/* 只读取需要的列，不把整条记录复制出来 */
+bool predicate_match(Predicate *predicate, void *value);
+bool predicate_exhausted(Predicate *predicate, void *value);
+void print_columns(FILE *out, void *value, Column *columns, uint32_t num_columns);
+
+/* 扫描一个表，将满足条件的记录交给 sink */
+void table_scan(Statement *statement, Table *table, RowSink *sink);
+void row_sink_init(RowSink *sink, Statement *statement, FILE *out);
+bool row_sink_emit(RowSink *sink, void *value);
+bool row_sink_emit_batch(RowSink *sink, void **values, uint32_t *selection, uint32_t count);
+
+/* 向量化执行：一次从连续的叶子中取出一批记录，对整批求值条件得到选择向量 */
+uint32_t table_gather(Table *table, Cursor *cursor, Predicate *where, void **values, uint32_t min_values, uint32_t max_values, bool *done);
+uint32_t predicate_select(Predicate *predicate, void **values, uint32_t count, uint32_t *selection);
+bool predicate_like(Predicate *predicate, const char *string, uint32_t size);
+void predicate_prepare_like(Predicate *predicate);
+bool like_match(const char *text, uint32_t size, const char *pattern);
+
+/* 聚合：count、min、max 和 group by */
+bool parse_aggregate(char *token, Aggregate *aggregate);
+Aggregator *aggregator_new(Statement *statement);
+void aggregator_free(Aggregator *aggregator);
+void aggregator_add_batch(Aggregator *aggregator, void **values, uint32_t *selection, uint32_t count);
+AggregateGroup *aggregator_group(Aggregator *aggregator, const char *key);
+void aggregate_update(Aggregate *aggregate, AggregateValue *result, void *value);
+void aggregator_finish(Aggregator *aggregator, RowSink *sink);
+int aggregate_group_compare(const void *a, const void *b);
+/* order by：内存中排序，超过预算时写入临时文件再多路归并 */
+Sorter *sorter_new(Column column, uint64_t limit);
+void sorter_free(Sorter *sorter);
+void sorter_add(Sorter *sorter, void *value);
+void sorter_finish(Sorter *sorter, RowSink *sink);
+void sorter_spill(Sorter *sorter);
+int sorter_file(Sorter *sorter, uint32_t file);
+void sorter_write_rows(Sorter *sorter, uint32_t file, struct iovec *iov, uint32_t count);
+void sorter_merge(Sorter *sorter, SortRun *runs, uint32_t num_runs, uint32_t fan_in, uint32_t buffer_rows,
+		  RowSink *sink, SortRun *output);
+bool sorter_read_row(Sorter *sorter, SortRunReader *reader, uint32_t buffer_rows, void *row);
+uint64_t sorter_prefix(Sorter *sorter, void *row);
+int sorter_compare(Sorter *sorter, SortEntry *a, SortEntry *b);
+int sorter_qsort_compare(const void *a, const void *b, void *argument);
+void sorter_sift_up(Sorter *sorter, SortEntry *heap, uint32_t index, int sign);
+void sorter_sift_down(Sorter *sorter, SortEntry *heap, uint32_t num_entries, uint32_t index, int sign);
+void *get_page(Pager* pager, uint64_t page_num);
+Pager* pager_open(const char *filename, bool cow);
 Table *db_open(const char *filename);
-void pager_flush(Pager *pager, uint32_t page_num);
+void pager_flush(Pager *pager, uint64_t page_num);
+void pager_flush_all(Pager *pager);
+void pager_read_ahead(Pager *pager, uint64_t page_num);
 void db_close(Table *table);
+void pager_close(Pager *pager);
+void pager_free(Pager *pager);
+uint64_t page_checksum(const void *data, size_t size);
+bool pager_read_meta(Pager *pager, uint32_t slot, void *meta);
+bool pager_load_newest_meta(Pager *pager);
+void cow_lock_open(Pager *pager, const char *filename);
+void cow_lock(Pager *pager);
+void cow_unlock(Pager *pager);
+void cow_reader_register(Pager *pager);
+void cow_reader_publish(Pager *pager);
+bool cow_reader_alive(CowReader *reader);
+void cow_remove_lock_file(const char *filename);
+bool pager_begin_write(Pager *pager);
+void db_begin_write(Table *table);
+void pager_write_meta(Pager *pager, uint32_t slot, uint64_t txn_id, uint64_t *page_map);
+void pager_commit(Pager *pager);
+void db_commit(Table *table);
+
+/* 从页框区中分配和归还一个页面 */
+void *pager_alloc_frame(Pager *pager);
+void pager_release_frame(Pager *pager, void *frame);
 Cursor *table_start(Table *table);
 void cursor_advance(Cursor *cursor);
 
+/* 返回指向第一个键大于等于 key 的记录的游标 */
+Cursor *table_lower_bound(Table *table, uint32_t key);
+
 /* 访问页节点中的属性*/
 uint32_t *leaf_node_num_cells(void *node);
 void *leaf_node_cell(void *node, uint32_t cell_num);
@@ -198,9 +860,13 @@ void print_constants();
 
 /* 在table 中朝对应的游标 */
 Cursor *table_find(Table *table, uint32_t key);
+void table_seek(Table *table, uint32_t key, Cursor *cursor);
+
+/* 利用最近插入的叶子定位游标，不在该叶子的范围内时返回 false */
+bool table_seek_hint(Table *table, uint32_t key, Cursor *cursor);
 
 /* 在叶子中朝相对应的游标 */
-Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key);
+void leaf_node_find(Table *table, uint64_t page_num, uint32_t key, Cursor *cursor);
 
 /* 获得节点的种类 */
 NodeType get_node_type(void *node);
@@ -212,18 +878,18 @@ void set_node_type(void *node, NodeType type);
 void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value);
 
 /* 获取未使用的页面编号 */
-uint32_t get_unused_page_num(Pager *pager);
+uint64_t get_unused_page_num(Pager *pager);
 
 /* 创建新的根节点 */
-void create_new_root(Table *table, uint32_t right_child_page_num);
+void create_new_root(Table *table, uint64_t right_child_page_num);
 
 uint32_t *internal_node_num_keys(void *node);
 
-uint32_t *internal_node_right_child(void *node);
+uint64_t *internal_node_right_child(void *node);
 
-uint32_t *internal_node_cell(void *node, uint32_t cell_num);
+void *internal_node_cell(void *node, uint32_t cell_num);
 
-uint32_t *internal_node_child(void *node, uint32_t child_num);
+uint64_t *internal_node_child(void *node, uint32_t child_num);
 
 uint32_t *internal_node_key(void *node, uint32_t key_num);
 
@@ -240,24 +906,148 @@ void initialize_internal_node(void *node);
 
 /* 打印整棵树 */
 void indent(uint32_t level);
-void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level);
-
-
-Cursor *internal_node_find(Table *table, uint32_t page_num, uint32_t key);
-
-uint32_t *leaf_node_next_leaf(void *node);
+void print_tree(Pager *pager, uint64_t page_num, uint32_t indentation_level);
+
+
+void internal_node_find(Table *table, uint64_t page_num, uint32_t key, Cursor *cursor);
+
+/* 返回内部节点中应当包含 key 的孩子的下标 */
+uint32_t internal_node_find_child(void *node, uint32_t key);
+
+/* 分裂之后更新父节点 */
+void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key);
+void internal_node_insert(Table *table, uint64_t parent_page_num, uint64_t child_page_num);
+
+uint64_t *leaf_node_next_leaf(void *node);
+
+uint64_t *node_parent(void *node);
+
+/* 访问文件头中的属性 */
+uint32_t *header_version(void *page);
+uint32_t *header_page_size(void *page);
+uint64_t *header_root_page_num(void *page);
+void initialize_header(void *page, uint64_t root_page_num);
+
+/* 重建整棵树，使叶子在文件中连续存放 */
+void db_vacuum(Table *table, uint32_t fill_factor);
+
+/* 将旧格式的文件转换为当前格式 */
+void db_migrate(const char *filename);
+bool legacy_file_valid(Pager *pager);
+
+/* 在 filename 后面加上 suffix，作为重建文件时的临时文件名 */
+char *temp_filename(const char *filename, const char *suffix);
+
+bool tree_builder_open(TreeBuilder *builder, const char *filename, uint64_t num_rows, uint32_t cells_per_leaf, bool cow);
+void tree_builder_append(TreeBuilder *builder, void *cell);
+uint64_t tree_builder_finish(TreeBuilder *builder);
+
+/* 分区表 */
+bool file_has_magic(const char *filename, const char *magic);
+Table *catalog_open(const char *filename);
+void catalog_write(Table *table, const char *filename);
+char *partition_filename(const char *filename, uint32_t partition);
+void db_partition(Table *table, uint32_t *lower_bounds, uint32_t num_partitions);
+uint32_t table_partition_index(Table *table, uint32_t key);
+bool partition_may_match(Table *table, uint32_t partition, Predicate *predicate);
+void *partition_scan_thread(void *argument);
+ssize_t partition_output_write(void *cookie, const char *data, size_t size);
+void partition_scan_drain(PartitionScan *scan, FILE *out);
+
+/* LSM 引擎 */
+Table *lsm_table_open(const char *filename);
+void lsm_close(LsmTree *lsm);
+ExecuteResult lsm_insert(LsmTree *lsm, Row *row);
+void lsm_scan(Statement *statement, LsmTree *lsm, RowSink *sink);
+void lsm_print(LsmTree *lsm);
+uint32_t lsm_row_key(void *row);
+int lsm_compare_rows(const void *a, const void *b);
+bool lsm_memtable_contains(LsmTree *lsm, uint32_t key);
+void lsm_sort_memtable(LsmTree *lsm);
+void lsm_flush_memtable(LsmTree *lsm);
+uint32_t lsm_level0_runs(LsmTree *lsm);
+void lsm_add_run(LsmTree *lsm, LsmRun *run);
+void lsm_write_manifest(LsmTree *lsm);
+void *lsm_compaction_thread(void *argument);
+uint32_t lsm_pick_compaction(LsmTree *lsm, LsmRun **inputs, uint32_t *target_level);
+LsmRun *lsm_merge_runs(LsmTree *lsm, LsmRun **inputs, uint32_t num_inputs, uint32_t level);
+LsmRun *lsm_run_open(const char *filename, uint64_t id, uint32_t level);
+void lsm_run_unref(LsmRun *run);
+uint32_t lsm_run_read_block(LsmRun *run, uint64_t block, uint8_t *rows);
+uint64_t lsm_run_find_block(LsmRun *run, uint32_t key);
+bool lsm_run_may_contain(LsmRun *run, uint32_t key);
+bool lsm_run_contains(LsmRun *run, uint32_t key, uint8_t *rows);
+uint64_t lsm_bloom_hash(uint32_t key, uint32_t i);
+void lsm_run_writer_open(LsmRunWriter *writer, LsmTree *lsm, uint32_t level, uint64_t expected_rows);
+void lsm_run_writer_append(LsmRunWriter *writer, void *row);
+void lsm_run_writer_flush_block(LsmRunWriter *writer);
+LsmRun *lsm_run_writer_finish(LsmRunWriter *writer);
+void lsm_source_init(LsmSource *source, LsmTree *lsm, LsmRun *run);
+void *lsm_source_value(LsmSource *source);
+void lsm_source_seek(LsmSource *source, uint32_t key);
+int32_t lsm_next_source(LsmSource *sources, uint32_t num_sources);
+
+/* 批处理模式 */
+void run_batch(Table *table, const char *source);
+bool batch_read_line(BatchQueue *queue, InputBuffer *input_buffer);
+bool batch_line_ready(BatchQueue *queue);
+bool batch_should_publish(BatchQueue *queue);
+bool batch_fill_buffer(BatchQueue *queue);
+void *batch_parser_thread(void *argument);
+BatchChunk *batch_next_chunk(BatchQueue *queue);
+void batch_release_chunk(BatchQueue *queue);
+
+/* 自适应哈希索引 */
+HashIndex *hash_index_new(uint32_t max_entries);
+void hash_index_free(HashIndex *index);
+void hash_index_reset(HashIndex *index);
+Cursor *hash_index_find(Table *table, uint32_t key);
+void hash_index_note_lookup(Table *table, uint64_t page_num);
+void hash_index_add_leaf(HashIndex *index, void *node, uint64_t page_num);
+void hash_index_invalidate(Table *table, uint64_t page_num);
+
+/* explain analyze */
+double elapsed_ms(struct timespec *start, struct timespec *end);
+void trace_phase(QueryPhase phase);
+void trace_page(uint64_t page_num, bool cache_miss);
+ExecuteResult execute_explain(Statement *statement, Table *table);
+void print_trace(QueryTrace *trace);
 
 int main(int argc, char *argv[]) {
     initialize();
-    if (argc < 2) {
+
+    char *filename = NULL;
+    char *batch_source = NULL;
+    for (int i = 1; i < argc; i++) {
+	if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+	    batch_source = argv[++i];
+	} else if (strcmp(argv[i], "--huge-pages") == 0) {
+	    pager_config.huge_pages = true;
+	} else if (strcmp(argv[i], "--direct-io") == 0) {
+	    pager_config.direct_io = true;
+	} else if (strcmp(argv[i], "--cow") == 0) {
+	    pager_config.cow = true;
+	} else if (strcmp(argv[i], "--lsm") == 0) {
+	    pager_config.lsm = true;
+	} else {
+	    filename = argv[i];
+	}
+    }
+
+    if (filename == NULL) {
         printf("Must supply a database filename.\n");
 	exit(EXIT_FAILURE);
     }
 
-    char *filename = argv[1];
     // 打开文件，并没有赋予空间
     Table *table = db_open(filename);
 
+    if (batch_source != NULL) {
+        run_batch(table, batch_source);
+	db_close(table);
+	return 0;
+    }
+
     InputBuffer* input_buffer = new_input_buffer();
     while (true) {
         print_prompt();
@@ -274,38 +1064,57 @@ int main(int argc, char *argv[]) {
 	}
 
 	Statement statement;
-	switch (prepare_statement(input_buffer, &statement)) {
-	    case (PREPARE_SUCCESS):
-	        break;
-	    case (PREPARE_NEGATIVE_ID):
-	        printf("ID must be positive.\n");
-		continue;
-	    case (PREPARE_STRING_TOO_LONG):
-	        printf("String is too long.\n");
-		continue;
-	    case (PREPARE_SYNTAX_ERROR):
-	        printf("Syntax error. Could not parse statement.\n");
-		continue;
-	    case (PREPARE_UNRECOGNIZED_STATEMENT):
-	        printf("Unrecognized keyword at start of '%s'\n", input_buffer->buffer);
-		continue;
+	PrepareResult prepare_result = prepare_statement(input_buffer, &statement);
+	if (prepare_result != PREPARE_SUCCESS) {
+	    print_prepare_error(prepare_result, input_buffer);
+	    continue;
 	}
 
-	switch (execute_statement(&statement, table)) {
-	    case (EXECUTE_SUCCESS):
-	        printf("Executed.\n");
-		break;
-	    case (EXECUTE_DUPLICATE_KEY):
-	        printf("Error: Duplicate key.\n");
-		break;
-	    case (EXECUTE_TABLE_FULL):
-	        printf("Error: Table full.\n");
-		break;
-        }
+	ExecuteResult execute_result = execute_statement(&statement, table);
+	if (execute_result == EXECUTE_SUCCESS) {
+	    if (statement.type == STATEMENT_INSERT) {
+	        db_commit(table);
+	    }
+	    printf("Executed.\n");
+	} else {
+	    print_execute_error(execute_result);
+	}
     }
     return 0;
 }
 
+void print_prepare_error(PrepareResult result, InputBuffer *input_buffer) {
+    switch (result) {
+        case (PREPARE_SUCCESS):
+	    break;
+	case (PREPARE_NEGATIVE_ID):
+	    printf("ID must be positive.\n");
+	    break;
+	case (PREPARE_STRING_TOO_LONG):
+	    printf("String is too long.\n");
+	    break;
+	case (PREPARE_SYNTAX_ERROR):
+	    printf("Syntax error. Could not parse statement.\n");
+	    break;
+	case (PREPARE_UNRECOGNIZED_STATEMENT):
+	    printf("Unrecognized keyword at start of '%s'\n", input_buffer->buffer);
+	    break;
+    }
+}
+
+void print_execute_error(ExecuteResult result) {
+    switch (result) {
+        case (EXECUTE_SUCCESS):
+	    break;
+	case (EXECUTE_DUPLICATE_KEY):
+	    printf("Error: Duplicate key.\n");
+	    break;
+	case (EXECUTE_TABLE_FULL):
+	    printf("Error: Table full.\n");
+	    break;
+    }
+}
+
 /* 结构初始化 */
 InputBuffer *new_input_buffer(void) {
     InputBuffer *input_buffer = malloc(sizeof(InputBuffer));
@@ -340,12 +1149,120 @@ void read_input(InputBuffer* input_buffer) {
 
 
 MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table) {
+    /* LSM 表没有 B 树，只支持查看各层的 run */
+    if (table->lsm != NULL) {
+	if (strcmp(input_buffer->buffer, ".lsm") == 0) {
+	    lsm_print(table->lsm);
+	    return META_COMMAND_SUCCESS;
+	}
+	if (strcmp(input_buffer->buffer, ".btree") == 0
+	    || strncmp(input_buffer->buffer, ".hash_index", 11) == 0
+	    || strncmp(input_buffer->buffer, ".vacuum", 7) == 0
+	    || strncmp(input_buffer->buffer, ".partition", 10) == 0) {
+	    printf("Not supported for LSM tables.\n");
+	    return META_COMMAND_SUCCESS;
+	}
+    }
+
+    /* 分区表的维护命令逐个作用在每个分区上 */
+    if (table->num_partitions > 0
+        && (strcmp(input_buffer->buffer, ".btree") == 0
+	    || strncmp(input_buffer->buffer, ".hash_index", 11) == 0
+	    || strncmp(input_buffer->buffer, ".vacuum", 7) == 0)) {
+	MetaCommandResult result = META_COMMAND_SUCCESS;
+	for (uint32_t i = 0; i < table->num_partitions && result == META_COMMAND_SUCCESS; i++) {
+	    printf("Partition %d (id >= %d):\n", i, table->partition_lower_bounds[i]);
+	    result = do_meta_command(input_buffer, table->partitions[i]);
+	}
+	return result;
+    }
+
     if (strcmp(input_buffer->buffer, ".exit") == 0) {
         db_close(table);
         exit(EXIT_SUCCESS);
     } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
         printf("Tree:\n");
-	print_tree(table->pager, 0, 0);
+	print_tree(table->pager, table->root_page_num, 0);
+	return META_COMMAND_SUCCESS;
+    } else if (strncmp(input_buffer->buffer, ".hash_index", 11) == 0) {
+	if (input_buffer->buffer[11] == ' ') {
+	    /* 修改容量，0 表示关闭。表中的记录不会超过 TABLE_MAX_PAGES 个叶子能容纳的个数 */
+	    long long max_entries = strtoll(input_buffer->buffer + 12, NULL, 10);
+	    if (max_entries < 0) {
+	        printf("Hash index size must not be negative.\n");
+		return META_COMMAND_SUCCESS;
+	    }
+	    if (max_entries > (long long)TABLE_MAX_PAGES * LEAF_NODE_MAX_CELLS) {
+	        printf("Hash index size must not exceed %d.\n", TABLE_MAX_PAGES * LEAF_NODE_MAX_CELLS);
+		return META_COMMAND_SUCCESS;
+	    }
+	    hash_index_free(table->hash_index);
+	    table->hash_index = max_entries > 0 ? hash_index_new(max_entries) : NULL;
+	} else if (input_buffer->buffer[11] != '\0') {
+	    return META_COMMAND_UNRECOGNIZED_COMMAND;
+	}
+
+	HashIndex *index = table->hash_index;
+	if (index == NULL) {
+	    printf("Hash index: off\n");
+	} else {
+	    printf("Hash index: %d/%d entries, %d hits, %d misses\n",
+	           index->num_entries, index->max_entries, index->hits, index->misses);
+	}
+	return META_COMMAND_SUCCESS;
+    } else if (strncmp(input_buffer->buffer, ".vacuum", 7) == 0) {
+	uint32_t fill_factor = VACUUM_DEFAULT_FILL_FACTOR;
+	if (input_buffer->buffer[7] == ' ') {
+	    fill_factor = atoi(input_buffer->buffer + 8);
+	} else if (input_buffer->buffer[7] != '\0') {
+	    return META_COMMAND_UNRECOGNIZED_COMMAND;
+	}
+	if (fill_factor == 0 || fill_factor > 100) {
+	    printf("Fill factor must be between 1 and 100.\n");
+	    return META_COMMAND_SUCCESS;
+	}
+	db_vacuum(table, fill_factor);
+	return META_COMMAND_SUCCESS;
+    } else if (strncmp(input_buffer->buffer, ".partition ", 11) == 0) {
+        if (table->num_partitions > 0) {
+	    printf("Table is already partitioned.\n");
+	    return META_COMMAND_SUCCESS;
+	}
+
+	/* .partition b1 b2 ... 将 id 划分为 [0, b1) [b1, b2) ... 几个区间 */
+	uint32_t lower_bounds[MAX_PARTITIONS];
+	uint32_t num_partitions = 1;
+	lower_bounds[0] = 0;
+	char *saveptr;
+	char *token = strtok_r(input_buffer->buffer + 11, " ", &saveptr);
+	while (token != NULL) {
+	    int bound = atoi(token);
+	    if (num_partitions >= MAX_PARTITIONS || bound <= (int)lower_bounds[num_partitions - 1]) {
+	        printf("Partition bounds must be increasing and positive, at most %d partitions.\n", MAX_PARTITIONS);
+		return META_COMMAND_SUCCESS;
+	    }
+	    lower_bounds[num_partitions] = bound;
+	    num_partitions += 1;
+	    token = strtok_r(NULL, " ", &saveptr);
+	}
+	if (num_partitions < 2) {
+	    printf("Must supply at least one partition bound.\n");
+	    return META_COMMAND_SUCCESS;
+	}
+
+	db_partition(table, lower_bounds, num_partitions);
+	return META_COMMAND_SUCCESS;
+    } else if (strncmp(input_buffer->buffer, ".sort_memory", 12) == 0) {
+	/* .sort_memory <kb> 修改 order by 的内存上限 */
+	if (input_buffer->buffer[12] == ' ') {
+	    int kilobytes = atoi(input_buffer->buffer + 13);
+	    if (kilobytes <= 0) {
+		printf("Sort memory must be positive.\n");
+		return META_COMMAND_SUCCESS;
+	    }
+	    sort_memory_budget = (uint64_t)kilobytes * 1024;
+	}
+	printf("Sort memory: %" PRIu64 " KB\n", sort_memory_budget / 1024);
 	return META_COMMAND_SUCCESS;
     } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
         printf("Constants:\n");
@@ -358,19 +1275,43 @@ MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table) {
 
 
 PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement) {
+    statement->explain = false;
+    statement->parse_ms = 0;
+
+    if (strncmp(input_buffer->buffer, "explain analyze ", 16) == 0) {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* 去掉前缀后按普通语句解析 */
+	size_t prefix_length = 16;
+	memmove(input_buffer->buffer, input_buffer->buffer + prefix_length,
+		input_buffer->input_length - prefix_length + 1);
+	input_buffer->input_length -= prefix_length;
+	PrepareResult result = prepare_statement(input_buffer, statement);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	statement->explain = true;
+	statement->parse_ms = elapsed_ms(&start, &end);
+	return result;
+    }
+
     if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
 	return prepare_insert(input_buffer, statement);
     }
 
-    if (strcmp(input_buffer->buffer, "select") == 0) {
-        statement->type = STATEMENT_SELECT;
-	return PREPARE_SUCCESS;
+    if (strncmp(input_buffer->buffer, "select", 6) == 0
+	&& (input_buffer->buffer[6] == '\0' || input_buffer->buffer[6] == ' ')) {
+	return prepare_select(input_buffer, statement);
     }
 
     return PREPARE_UNRECOGNIZED_STATEMENT;
 }
 
 ExecuteResult execute_statement(Statement *statement, Table *table) {
+    if (statement->explain && active_trace == NULL) {
+	return execute_explain(statement, table);
+    }
+
     switch (statement->type) {
         case (STATEMENT_INSERT):
 	    return execute_insert(statement, table);
@@ -413,567 +1354,4289 @@ void initialize() {
         INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
     INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE;
 
+    /* B 树内部节点体布局 */
+    INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
+    INTERNAL_NODE_SPACE_FOR_CELLS = PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE;
+    INTERNAL_NODE_MAX_CELLS = INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE;
+
+    /* 文件头布局 */
+    HEADER_VERSION_OFFSET = HEADER_MAGIC_OFFSET + HEADER_MAGIC_SIZE;
+    HEADER_PAGE_SIZE_OFFSET = HEADER_VERSION_OFFSET + HEADER_VERSION_SIZE;
+    HEADER_ROOT_PAGE_NUM_OFFSET = HEADER_PAGE_SIZE_OFFSET + HEADER_PAGE_SIZE_SIZE;
+
 }
 
 
 ExecuteResult execute_insert(Statement *statement, Table *table) {
-    /* 判断表是否已满 */
-    void *node = get_page(table->pager, table->root_page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
-
     Row *row_to_insert = &(statement->row_to_insert);
     uint32_t key_to_insert = row_to_insert->id;
-    Cursor *cursor = table_find(table, key_to_insert);
+    if (table->num_partitions > 0) {
+        table = table->partitions[table_partition_index(table, key_to_insert)];
+    }
+    if (table->lsm != NULL) {
+	return lsm_insert(table->lsm, row_to_insert);
+    }
+    db_begin_write(table);
 
-    if (cursor->cell_num < num_cells) {
-        uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
+    /* 游标放在栈上，键在最近插入的叶子范围内时不需要从根节点下降 */
+    trace_phase(PHASE_SEEK);
+    Cursor cursor;
+    if (!table_seek_hint(table, key_to_insert, &cursor)) {
+	table_seek(table, key_to_insert, &cursor);
+    }
+
+    trace_phase(PHASE_SCAN);
+    void *node = get_page(table->pager, cursor.page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (cursor.cell_num < num_cells) {
+	uint32_t key_at_index = *leaf_node_key(node, cursor.cell_num);
+	if (active_trace) {
+	    active_trace->rows_examined += 1;
+	}
 	if(key_at_index == key_to_insert) {
 	    return EXECUTE_DUPLICATE_KEY;
 	}
     }
 
-    leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
-    free(cursor);
+    /* 判断表是否已满，分裂根节点时需要两个新页面 */
+    if (num_cells >= LEAF_NODE_MAX_CELLS && table->pager->num_pages + 2 > TABLE_MAX_PAGES) {
+	return EXECUTE_TABLE_FULL;
+    }
+
+    leaf_node_insert(&cursor, row_to_insert->id, row_to_insert);
 
     return EXECUTE_SUCCESS;
 }
 
 
 ExecuteResult execute_select(Statement *statement, Table *table) {
-    Cursor *cursor = table_start(table);
-    
-    Row row;
-    while (!(cursor->end_of_table)) {
-        deserialize_row(cursor_value(cursor), &row);
-	print_row(&row);
-	cursor_advance(cursor);
+    if (statement->has_limit && statement->limit == 0) {
+	return EXECUTE_SUCCESS;
     }
 
-    free(cursor);
-    return EXECUTE_SUCCESS;
-}
+    RowSink sink;
+    row_sink_init(&sink, statement, stdout);
+    if (statement->has_order_by) {
+	sink.sorter = sorter_new(statement->order_by, statement->has_limit ? statement->limit : 0);
+    }
+    if (statement->num_aggregates > 0 || statement->has_group_by) {
+	sink.aggregator = aggregator_new(statement);
+    }
 
-void print_row(Row *row) {
-    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
-}
+    if (table->num_partitions == 0) {
+        table_scan(statement, table, &sink);
+    } else {
+	/* 只扫描可能包含满足条件的记录的分区。explain analyze 的统计不是线程安全的，
+	 * order by、limit 和聚合需要看到所有分区的结果，这些情况下逐个扫描分区。 */
+	bool sequential = active_trace || sink.sorter != NULL || sink.aggregator != NULL || sink.has_limit;
+	PartitionScan scans[MAX_PARTITIONS];
+	uint32_t num_scans = 0;
+	for (uint32_t i = 0; i < table->num_partitions; i++) {
+	    if (!partition_may_match(table, i, &(statement->where))) {
+		continue;
+	    }
+	    if (sequential) {
+		if (sink.has_limit && sink.remaining == 0) {
+		    break;
+		}
+		table_scan(statement, table->partitions[i], &sink);
+		continue;
+	    }
 
-void serialize_row(Row *source, void *destination) {
-    memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-    memcpy(destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
-    memcpy(destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
-}
+	    PartitionScan *scan = &(scans[num_scans]);
+	    scan->statement = statement;
+	    scan->table = table->partitions[i];
+	    scan->buffer = malloc(PARTITION_OUTPUT_BUFFER_SIZE);
+	    scan->length = 0;
+	    scan->finished = false;
+	    pthread_mutex_init(&(scan->mutex), NULL);
+	    pthread_cond_init(&(scan->changed), NULL);
+	    if (pthread_create(&(scan->thread), NULL, partition_scan_thread, scan) != 0) {
+		printf("Unable to start partition scan.\n");
+		exit(EXIT_FAILURE);
+	    }
+	    num_scans += 1;
+	}
 
+	/* 分区按 id 的区间排列，按顺序输出即保持 id 的顺序。后面的分区写满缓冲区后等待轮到自己 */
+	for (uint32_t i = 0; i < num_scans; i++) {
+	    partition_scan_drain(&(scans[i]), stdout);
+	    pthread_join(scans[i].thread, NULL);
+	    pthread_mutex_destroy(&(scans[i].mutex));
+	    pthread_cond_destroy(&(scans[i].changed));
+	    free(scans[i].buffer);
+	}
+    }
 
-void deserialize_row(void *source, Row *destination) {
-    memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-    memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-    memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+    if (sink.sorter != NULL) {
+	Sorter *sorter = sink.sorter;
+	sink.sorter = NULL;
+	trace_phase(PHASE_OUTPUT);
+	sorter_finish(sorter, &sink);
+	sorter_free(sorter);
+    }
+    if (sink.aggregator != NULL) {
+	Aggregator *aggregator = sink.aggregator;
+	sink.aggregator = NULL;
+	trace_phase(PHASE_OUTPUT);
+	aggregator_finish(aggregator, &sink);
+	aggregator_free(aggregator);
+    }
+
+    return EXECUTE_SUCCESS;
 }
 
+void table_scan(Statement *statement, Table *table, RowSink *sink) {
+    if (table->lsm != NULL) {
+	lsm_scan(statement, table->lsm, sink);
+	return;
+    }
 
-void *cursor_value(Cursor *cursor) {
-    uint32_t page_num = cursor->page_num;
-    /* 获得那一页的指针 */
-    void *page = get_page(cursor->table->pager, page_num);
-    return leaf_node_value(page, cursor->cell_num);
-}
+    Predicate *where = &(statement->where);
+
+    /* 条件给出了 id 的下界时，直接定位到起始的叶子 */
+    trace_phase(PHASE_SEEK);
+    Cursor *cursor;
+    if (where->enabled && where->column == COLUMN_ID && where->op == COMPARE_EQUAL
+	&& (cursor = hash_index_find(table, where->id)) != NULL) {
+	/* 点查命中哈希索引，不需要从根节点下降 */
+    } else if (where->enabled && where->column == COLUMN_ID
+	&& (where->op == COMPARE_EQUAL || where->op == COMPARE_GREATER_EQUAL || where->op == COMPARE_GREATER)) {
+	cursor = table_lower_bound(table, where->id);
+	if (where->op == COMPARE_EQUAL && !(cursor->end_of_table)) {
+	    hash_index_note_lookup(table, cursor->page_num);
+	}
+    } else {
+	cursor = table_start(table);
+    }
 
-PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement) {
-    // 将声明置为插入语句
-    statement->type = STATEMENT_INSERT;
+    /* 一次取出一批记录，整批求值条件，再把选中的记录交给 sink */
+    void *values[VECTOR_BATCH_SIZE];
+    uint32_t selection[VECTOR_BATCH_SIZE];
+    bool id_equal = where->enabled && where->column == COLUMN_ID && where->op == COMPARE_EQUAL;
+    bool done = false;
+    while (!done && !(cursor->end_of_table)) {
+	/* 有 limit 而且直接输出时，取到的记录够剩下的行数就在叶子的末尾停下。
+	 * 没有条件或者条件在 id 上时，从游标处起的记录在条件的上界之前都满足条件，只需要取剩下的行数。 */
+	uint32_t batch_size = VECTOR_BATCH_SIZE;
+	uint32_t min_values = VECTOR_BATCH_SIZE;
+	if (sink->has_limit && sink->sorter == NULL && sink->aggregator == NULL
+	    && sink->remaining < batch_size) {
+	    min_values = sink->remaining;
+	    if (!(where->enabled) || (where->column == COLUMN_ID && where->op != COMPARE_NOT_EQUAL)) {
+		batch_size = sink->remaining;
+	    }
+	}
+	/* id 是唯一的，游标指向的记录就是唯一可能满足等值条件的记录 */
+	if (id_equal) {
+	    batch_size = 1;
+	    min_values = 1;
+	}
 
-    // strtok() 函数为不可重入函数，不安全。
-    char *keyword = strtok(input_buffer->buffer, " ");
-    char *id_string = strtok(NULL, " ");
-    char *username = strtok(NULL, " ");
-    char *email = strtok(NULL, " ");
+	trace_phase(PHASE_SCAN);
+	uint32_t count = table_gather(table, cursor, where, values, min_values, batch_size, &done);
+	uint32_t selected = predicate_select(where, values, count, selection);
+	if (active_trace) {
+	    active_trace->rows_examined += count;
+	}
+	if (id_equal) {
+	    done = true;
+	}
 
-    if (id_string == NULL || username == NULL || email == NULL) {
-        return PREPARE_SYNTAX_ERROR;
+	trace_phase(PHASE_OUTPUT);
+	if (!row_sink_emit_batch(sink, values, selection, selected)) {
+	    break;
+	}
     }
 
-    int id = atoi(id_string);
-    if (id < 0) {
-        return PREPARE_NEGATIVE_ID;
-    }
+    free(cursor);
+}
 
-    if (strlen(username) > COLUMN_USERNAME_SIZE) {
-        return PREPARE_STRING_TOO_LONG;
+void row_sink_init(RowSink *sink, Statement *statement, FILE *out) {
+    sink->out = out;
+    sink->columns = statement->columns;
+    sink->num_columns = statement->num_columns;
+    sink->has_limit = statement->has_limit;
+    sink->remaining = statement->limit;
+    sink->sorter = NULL;
+    sink->aggregator = NULL;
+}
+
+/* 返回 false 表示已经输出了 limit 行，扫描可以停止 */
+bool row_sink_emit(RowSink *sink, void *value) {
+    if (sink->aggregator != NULL) {
+	uint32_t selection = 0;
+	aggregator_add_batch(sink->aggregator, &value, &selection, 1);
+	return true;
+    }
+    if (sink->sorter != NULL) {
+	sorter_add(sink->sorter, value);
+	return true;
+    }
+    if (sink->has_limit && sink->remaining == 0) {
+	return false;
     }
 
-    if (strlen(email) > COLUMN_EMAIL_SIZE) {
-        return PREPARE_STRING_TOO_LONG;
+    print_columns(sink->out, value, sink->columns, sink->num_columns);
+    if (active_trace) {
+	active_trace->rows_returned += 1;
+    }
+    if (sink->has_limit) {
+	sink->remaining -= 1;
+	return sink->remaining > 0;
     }
+    return true;
+}
 
-    statement->row_to_insert.id = id;
-    strcpy(statement->row_to_insert.username, username);
-    strcpy(statement->row_to_insert.email, email);
+/* 从游标处起沿着叶子的链表取出最多 max_values 条记录的指针，页面不会被换出，指针一直有效。
+ * 一个叶子取完后如果最后一条记录已经超过条件的上界，设置 done，不再读之后的叶子。 */
+/* 从游标处起沿着叶子的链表取出最多 max_values 条记录的指针，页面不会被换出，指针一直有效。
+ * 一个叶子取完后如果已经取到 min_values 条，或者最后一条记录已经超过条件的上界，就在这个叶子停下，
+ * 游标留在叶子的末尾，下一次调用时才前进到下一个叶子，所以停下时不会读入之后的叶子。 */
+uint32_t table_gather(Table *table, Cursor *cursor, Predicate *where, void **values, uint32_t min_values, uint32_t max_values, bool *done) {
+    uint32_t count = 0;
+    while (count < max_values && !(cursor->end_of_table)) {
+	void *node = get_page(table->pager, cursor->page_num);
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	if (num_cells == 0) {
+	    cursor->end_of_table = true;
+	    break;
+	}
+	if (cursor->cell_num >= num_cells) {
+	    cursor->cell_num = num_cells - 1;
+	    cursor_advance(cursor);
+	    continue;
+	}
 
-    return PREPARE_SUCCESS;
+	uint32_t take = num_cells - cursor->cell_num;
+	if (take > max_values - count) {
+	    take = max_values - count;
+	}
+	for (uint32_t i = 0; i < take; i++) {
+	    values[count + i] = leaf_node_value(node, cursor->cell_num + i);
+	}
+	count += take;
+	cursor->cell_num += take;
+
+	if (where->enabled && predicate_exhausted(where, values[count - 1])) {
+	    *done = true;
+	    break;
+	}
+	if (count >= min_values) {
+	    break;
+	}
+    }
+    return count;
 }
 
-Table *db_open(const char *filename) {
-    Pager *pager = pager_open(filename);
+/* 聚合时整批交给 Aggregator，否则逐行输出 */
+bool row_sink_emit_batch(RowSink *sink, void **values, uint32_t *selection, uint32_t count) {
+    if (sink->aggregator != NULL) {
+	aggregator_add_batch(sink->aggregator, values, selection, count);
+	return true;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+	if (!row_sink_emit(sink, values[selection[i]])) {
+	    return false;
+	}
+    }
+    return true;
+}
 
-    Table *table = malloc(sizeof(Table));
-    table->pager = pager;
-    table->root_page_num = 0;
+/* count、count(*)、count(列)、min(列)、max(列)。每一列都不会为空，count(列) 与 count(*) 相同 */
+bool parse_aggregate(char *token, Aggregate *aggregate) {
+    if (strcmp(token, "count") == 0 || strcmp(token, "count(*)") == 0) {
+	aggregate->function = AGGREGATE_COUNT;
+	aggregate->column = COLUMN_ID;
+	return true;
+    }
 
-    if (pager->num_pages == 0) {
-        void *root_node = get_page(pager, 0);
-	initialize_leaf_node(root_node);
-	set_node_root(root_node, true);
+    char *open = strchr(token, '(');
+    size_t length = strlen(token);
+    if (open == NULL || token[length - 1] != ')') {
+	return false;
+    }
+    *open = '\0';
+    token[length - 1] = '\0';
+    if (!parse_column(open + 1, &(aggregate->column))) {
+	return false;
     }
 
-    return table;
+    if (strcmp(token, "count") == 0) {
+	aggregate->function = AGGREGATE_COUNT;
+    } else if (strcmp(token, "min") == 0) {
+	aggregate->function = AGGREGATE_MIN;
+    } else if (strcmp(token, "max") == 0) {
+	aggregate->function = AGGREGATE_MAX;
+    } else {
+	return false;
+    }
+    return true;
 }
 
-void *get_page(Pager* pager, uint32_t page_num) {
-    if (page_num > TABLE_MAX_PAGES) {
-        printf("Tried to fetch page number out of bounds. %d > %d\n", page_num, TABLE_MAX_PAGES);
-	exit(EXIT_FAILURE);
+/* 没有 group by 时预先建好唯一的分组，空表也输出一行 */
+Aggregator *aggregator_new(Statement *statement) {
+    Aggregator *aggregator = malloc(sizeof(Aggregator));
+    aggregator->aggregates = statement->aggregates;
+    aggregator->num_aggregates = statement->num_aggregates;
+    aggregator->has_group_by = statement->has_group_by;
+    aggregator->group_offset = statement->group_by == COLUMN_USERNAME ? USERNAME_OFFSET : EMAIL_OFFSET;
+    aggregator->group_size = statement->group_by == COLUMN_USERNAME ? USERNAME_SIZE : EMAIL_SIZE;
+    aggregator->capacity = 64;
+    aggregator->groups = calloc(aggregator->capacity, sizeof(AggregateGroup));
+    aggregator->num_groups = 0;
+    if (!(aggregator->has_group_by)) {
+	aggregator_group(aggregator, "");
     }
+    return aggregator;
+}
 
-    // 这里意味着只有当用的时候才将数据从磁盘当中读取出来
-    if (pager->pages[page_num] == NULL) {
-        // Cache miss. Allocate memory and load from file.
-	void *page = malloc(PAGE_SIZE);
-	uint32_t num_pages = pager->file_length / PAGE_SIZE;
+void aggregator_free(Aggregator *aggregator) {
+    for (uint32_t i = 0; i < aggregator->capacity; i++) {
+	AggregateGroup *group = &(aggregator->groups[i]);
+	if (!(group->used)) {
+	    continue;
+	}
+	free(group->key);
+	for (uint32_t j = 0; j < aggregator->num_aggregates; j++) {
+	    free(group->values[j].string);
+	}
+    }
+    free(aggregator->groups);
+    free(aggregator);
+}
 
-	// We might save a partial page at the end of the file
-	if (pager->file_length % PAGE_SIZE) {
-	    num_pages += 1;
+/* 开放定址、线性探测，装载因子超过一半时容量翻倍 */
+AggregateGroup *aggregator_group(Aggregator *aggregator, const char *key) {
+    uint32_t mask = aggregator->capacity - 1;
+    uint32_t index = page_checksum(key, strlen(key)) & mask;
+    while (aggregator->groups[index].used) {
+	if (strcmp(aggregator->groups[index].key, key) == 0) {
+	    return &(aggregator->groups[index]);
 	}
+	index = (index + 1) & mask;
+    }
 
-	// 如果小于意味可以从文件中读取出来
-	if (page_num <= num_pages) {
-	    lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-	    ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-	    if (bytes_read == -1) {
-	        printf("Error reading file: %d\n", errno);
-		exit(EXIT_FAILURE);
+    if ((aggregator->num_groups + 1) * 2 > aggregator->capacity) {
+	AggregateGroup *old_groups = aggregator->groups;
+	uint32_t old_capacity = aggregator->capacity;
+	aggregator->capacity *= 2;
+	aggregator->groups = calloc(aggregator->capacity, sizeof(AggregateGroup));
+	mask = aggregator->capacity - 1;
+	for (uint32_t i = 0; i < old_capacity; i++) {
+	    if (!(old_groups[i].used)) {
+		continue;
+	    }
+	    uint32_t slot = page_checksum(old_groups[i].key, strlen(old_groups[i].key)) & mask;
+	    while (aggregator->groups[slot].used) {
+		slot = (slot + 1) & mask;
 	    }
+	    aggregator->groups[slot] = old_groups[i];
 	}
+	free(old_groups);
+	return aggregator_group(aggregator, key);
+    }
 
-	pager->pages[page_num] = page;
+    AggregateGroup *group = &(aggregator->groups[index]);
+    memset(group, 0, sizeof(AggregateGroup));
+    group->used = true;
+    group->key = strdup(key);
+    aggregator->num_groups += 1;
+    return group;
+}
 
-	if (page_num >= pager->num_pages) {
-	    pager->num_pages = page_num + 1;
+/* 用一行记录更新 min 或 max 的结果，字符串只在结果改变时复制 */
+void aggregate_update(Aggregate *aggregate, AggregateValue *result, void *value) {
+    if (aggregate->function == AGGREGATE_COUNT) {
+	return;
+    }
+    int sign = aggregate->function == AGGREGATE_MIN ? -1 : 1;
+    if (aggregate->column == COLUMN_ID) {
+	uint32_t id;
+	memcpy(&id, value + ID_OFFSET, ID_SIZE);
+	if (!(result->has_value) || (sign < 0 ? id < result->id : id > result->id)) {
+	    result->id = id;
+	    result->has_value = true;
 	}
+	return;
     }
 
-    return pager->pages[page_num];
+    uint32_t offset = aggregate->column == COLUMN_USERNAME ? USERNAME_OFFSET : EMAIL_OFFSET;
+    uint32_t size = aggregate->column == COLUMN_USERNAME ? USERNAME_SIZE : EMAIL_SIZE;
+    const char *string = value + offset;
+    if (!(result->has_value) || sign * strncmp(string, result->string, size) > 0) {
+	free(result->string);
+	result->string = strndup(string, size);
+	result->has_value = true;
+    }
 }
 
-Pager* pager_open(const char *filename) {
-    /* O_RDWR  -> Read/Write mode
-     * O_CREAT -> Create file if it does not exist
-     * S_IWUSR -> User write permission
-     * S_IRUSR -> User read permission */
-    int fd = open(filename, O_RDWR | O_APPEND | S_IWUSR | S_IRUSR);
+/* 没有 group by 时 count 直接加上批的大小，id 的 min、max 是没有分支的循环 */
+void aggregator_add_batch(Aggregator *aggregator, void **values, uint32_t *selection, uint32_t count) {
+    if (count == 0) {
+	return;
+    }
 
-    if (fd == -1) {
-        fd = open(filename, O_RDWR | O_CREAT | S_IWUSR | S_IRUSR);
+    if (aggregator->has_group_by) {
+	for (uint32_t i = 0; i < count; i++) {
+	    void *value = values[selection[i]];
+	    AggregateGroup *group = aggregator_group(aggregator, value + aggregator->group_offset);
+	    group->count += 1;
+	    for (uint32_t j = 0; j < aggregator->num_aggregates; j++) {
+		aggregate_update(&(aggregator->aggregates[j]), &(group->values[j]), value);
+	    }
+	}
+	return;
     }
 
-    if (fd == -1) {
-        printf("Unable to open file\n");
-	exit(EXIT_FAILURE);
+    AggregateGroup *group = aggregator_group(aggregator, "");
+    group->count += count;
+    for (uint32_t j = 0; j < aggregator->num_aggregates; j++) {
+	Aggregate *aggregate = &(aggregator->aggregates[j]);
+	if (aggregate->function == AGGREGATE_COUNT) {
+	    continue;
+	}
+	if (aggregate->column != COLUMN_ID) {
+	    for (uint32_t i = 0; i < count; i++) {
+		aggregate_update(aggregate, &(group->values[j]), values[selection[i]]);
+	    }
+	    continue;
+	}
+
+	uint32_t minimum = UINT32_MAX;
+	uint32_t maximum = 0;
+	for (uint32_t i = 0; i < count; i++) {
+	    uint32_t id;
+	    memcpy(&id, values[selection[i]] + ID_OFFSET, ID_SIZE);
+	    minimum = id < minimum ? id : minimum;
+	    maximum = id > maximum ? id : maximum;
+	}
+	AggregateValue *result = &(group->values[j]);
+	uint32_t id = aggregate->function == AGGREGATE_MIN ? minimum : maximum;
+	if (!(result->has_value) || (aggregate->function == AGGREGATE_MIN ? id < result->id : id > result->id)) {
+	    result->id = id;
+	    result->has_value = true;
+	}
     }
+}
 
-    off_t file_length = lseek(fd, 0, SEEK_END);
+int aggregate_group_compare(const void *a, const void *b) {
+    return strcmp((*(AggregateGroup **)a)->key, (*(AggregateGroup **)b)->key);
+}
 
-    Pager *pager = malloc(sizeof(Pager));
-    pager->file_descriptor = fd;
-    pager->file_length = file_length;
-    pager->num_pages = (file_length / PAGE_SIZE);
+/* 分组按键排序后输出，先输出 select 中的分组列，再输出各个聚合函数，没有值时输出 NULL */
+void aggregator_finish(Aggregator *aggregator, RowSink *sink) {
+    AggregateGroup **groups = malloc(aggregator->num_groups * sizeof(AggregateGroup *));
+    uint32_t num_groups = 0;
+    for (uint32_t i = 0; i < aggregator->capacity; i++) {
+	if (aggregator->groups[i].used) {
+	    groups[num_groups] = &(aggregator->groups[i]);
+	    num_groups += 1;
+	}
+    }
+    qsort(groups, num_groups, sizeof(AggregateGroup *), aggregate_group_compare);
 
-    if (file_length % PAGE_SIZE != 0) {
-        printf("Db file is not a whole number of pages. Corrupte file.\n");
-	exit(EXIT_FAILURE);
+    for (uint32_t i = 0; i < num_groups; i++) {
+	if (sink->has_limit && sink->remaining == 0) {
+	    break;
+	}
+	AggregateGroup *group = groups[i];
+	uint32_t printed = 0;
+	fputc('(', sink->out);
+	for (uint32_t j = 0; j < sink->num_columns; j++, printed++) {
+	    fputs(printed > 0 ? ", " : "", sink->out);
+	    fputs(group->key, sink->out);
+	}
+	for (uint32_t j = 0; j < aggregator->num_aggregates; j++, printed++) {
+	    fputs(printed > 0 ? ", " : "", sink->out);
+	    Aggregate *aggregate = &(aggregator->aggregates[j]);
+	    AggregateValue *result = &(group->values[j]);
+	    if (aggregate->function == AGGREGATE_COUNT) {
+		fprintf(sink->out, "%" PRIu64, group->count);
+	    } else if (!(result->has_value)) {
+		fputs("NULL", sink->out);
+	    } else if (aggregate->column == COLUMN_ID) {
+		fprintf(sink->out, "%d", result->id);
+	    } else {
+		fputs(result->string, sink->out);
+	    }
+	}
+	fputs(")\n", sink->out);
+	if (active_trace) {
+	    active_trace->rows_returned += 1;
+	}
+	if (sink->has_limit) {
+	    sink->remaining -= 1;
+	}
     }
+    free(groups);
+}
 
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        pager->pages[i] = NULL;
+/* limit 不超过内存预算时只保留最小的 limit 行，否则使用外部排序 */
+Sorter *sorter_new(Column column, uint64_t limit) {
+    Sorter *sorter = malloc(sizeof(Sorter));
+    sorter->offset = column == COLUMN_USERNAME ? USERNAME_OFFSET : EMAIL_OFFSET;
+    sorter->size = column == COLUMN_USERNAME ? USERNAME_SIZE : EMAIL_SIZE;
+    sorter->max_rows = sort_memory_budget / (ROW_SIZE + sizeof(SortEntry));
+    if (sorter->max_rows == 0) {
+	sorter->max_rows = 1;
     }
+    sorter->top_n = limit > 0 && limit <= sorter->max_rows;
+    if (sorter->top_n) {
+	sorter->max_rows = limit;
+    }
+    /* 归并时读写缓冲区和每一段的当前记录都使用 rows 的空间 */
+    uint32_t rows_capacity = sorter->max_rows < SORT_MIN_MERGE_ROWS ? SORT_MIN_MERGE_ROWS : sorter->max_rows;
+    sorter->rows = malloc((size_t)rows_capacity * ROW_SIZE);
+    sorter->entries = malloc((size_t)rows_capacity * sizeof(SortEntry));
+    sorter->num_rows = 0;
+    sorter->files[0] = NULL;
+    sorter->files[1] = NULL;
+    sorter->file_ends[0] = 0;
+    sorter->file_ends[1] = 0;
+    sorter->current_file = 0;
+    sorter->runs = NULL;
+    sorter->num_runs = 0;
+    return sorter;
+}
 
-    return pager;
+void sorter_free(Sorter *sorter) {
+    for (uint32_t i = 0; i < 2; i++) {
+	if (sorter->files[i] != NULL) {
+	    fclose(sorter->files[i]);
+	}
+    }
+    free(sorter->runs);
+    free(sorter->rows);
+    free(sorter->entries);
+    free(sorter);
 }
 
-void db_close(Table *table) {
-    Pager *pager = table->pager;
-    
-    // 存放整数页
-    for (uint32_t i = 0; i < pager->num_pages; i++) {
-        if (pager->pages[i] == NULL) {
-	    continue;
+void sorter_add(Sorter *sorter, void *value) {
+    if (sorter->top_n) {
+	/* 大顶堆保存目前最小的 max_rows 行，新的一行比堆顶小时替换堆顶 */
+	SortEntry entry = { sorter_prefix(sorter, value), value };
+	if (sorter->num_rows < sorter->max_rows) {
+	    entry.row = sorter->rows + (size_t)sorter->num_rows * ROW_SIZE;
+	    memcpy(entry.row, value, ROW_SIZE);
+	    sorter->entries[sorter->num_rows] = entry;
+	    sorter->num_rows += 1;
+	    sorter_sift_up(sorter, sorter->entries, sorter->num_rows - 1, 1);
+	} else if (sorter_compare(sorter, &entry, &(sorter->entries[0])) < 0) {
+	    memcpy(sorter->entries[0].row, value, ROW_SIZE);
+	    sorter->entries[0].prefix = entry.prefix;
+	    sorter_sift_down(sorter, sorter->entries, sorter->num_rows, 0, 1);
 	}
-	pager_flush(pager, i);
-	free(pager->pages[i]);
-	pager->pages[i] = NULL;
+	return;
     }
 
-    // 关闭文件
-    int result = close(pager->file_descriptor);
-    if (result == -1) {
-        printf("Error closing db file.\n");
-	exit(EXIT_FAILURE);
+    if (sorter->num_rows == sorter->max_rows) {
+	sorter_spill(sorter);
     }
+    void *row = sorter->rows + (size_t)sorter->num_rows * ROW_SIZE;
+    memcpy(row, value, ROW_SIZE);
+    sorter->entries[sorter->num_rows].prefix = sorter_prefix(sorter, row);
+    sorter->entries[sorter->num_rows].row = row;
+    sorter->num_rows += 1;
+}
 
-    // 释放空间
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        void *page = pager->pages[i];
-	if (page) {
-	    free(page);
-	    pager->pages[i] = NULL;
+/* 没有写过临时文件时直接在内存中排序输出，否则把最后一段也写出去，再用小顶堆多路归并 */
+/* 没有写过临时文件时直接在内存中排序输出。否则把最后一段也写出去，rows 的空间分给归并的缓冲区：
+ * 路数超过 fan_in 时每次归并 fan_in 段写入另一个临时文件，直到剩下的段可以一次归并输出 */
+void sorter_finish(Sorter *sorter, RowSink *sink) {
+    if (sorter->num_runs == 0) {
+	qsort_r(sorter->entries, sorter->num_rows, sizeof(SortEntry), sorter_qsort_compare, sorter);
+	for (uint32_t i = 0; i < sorter->num_rows; i++) {
+	    if (!row_sink_emit(sink, sorter->entries[i].row)) {
+		break;
+	    }
 	}
+	return;
     }
-    // 释放空间
-    free(pager);
-}
 
-void pager_flush(Pager *pager, uint32_t page_num) {
-    // 存空页则报错
-    if (pager->pages[page_num] == NULL) {
-        printf("Tried to flush null page\n");
-	exit(EXIT_FAILURE);
+    if (sorter->num_rows > 0) {
+	sorter_spill(sorter);
     }
 
-    off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+    /* fan_in 路各有 buffer_rows 行的读缓冲区和一行当前记录，另有 buffer_rows 行的写缓冲区。
+     * 缓冲区不小于 SORT_MIN_BUFFER_SIZE 时路数尽量多，剩下的空间再分给缓冲区，最多 SORT_RUN_BUFFER_SIZE */
+    uint32_t rows_capacity = sorter->max_rows < SORT_MIN_MERGE_ROWS ? SORT_MIN_MERGE_ROWS : sorter->max_rows;
+    uint32_t min_buffer_rows = SORT_MIN_BUFFER_SIZE / ROW_SIZE > 0 ? SORT_MIN_BUFFER_SIZE / ROW_SIZE : 1;
+    uint32_t fan_in = rows_capacity > min_buffer_rows ? (rows_capacity - min_buffer_rows) / (min_buffer_rows + 1) : 0;
+    if (fan_in > sorter->num_runs) {
+	fan_in = sorter->num_runs;
+    }
+    if (fan_in < 2) {
+	fan_in = 2;
+    }
+    uint32_t buffer_rows = (rows_capacity - fan_in) / (fan_in + 1);
+    if (buffer_rows > SORT_RUN_BUFFER_SIZE / ROW_SIZE) {
+	buffer_rows = SORT_RUN_BUFFER_SIZE / ROW_SIZE;
+    }
 
-    if (offset == -1) {
-        printf("Error seeking: %d\n", errno);
-	exit(EXIT_FAILURE);
+    while (sorter->num_runs > fan_in) {
+	uint32_t input = sorter->current_file;
+	uint32_t output = 1 - input;
+	sorter_file(sorter, output);
+	if (ftruncate(fileno(sorter->files[output]), 0) == -1) {
+	    printf("Error truncating temporary file: %d\n", errno);
+	    exit(EXIT_FAILURE);
+	}
+	sorter->file_ends[output] = 0;
+
+	uint32_t num_outputs = 0;
+	for (uint32_t i = 0; i < sorter->num_runs; i += fan_in) {
+	    uint32_t count = sorter->num_runs - i < fan_in ? sorter->num_runs - i : fan_in;
+	    SortRun merged;
+	    sorter->current_file = input;
+	    sorter_merge(sorter, sorter->runs + i, count, fan_in, buffer_rows, NULL, &merged);
+	    sorter->runs[num_outputs] = merged;
+	    num_outputs += 1;
+	}
+	sorter->num_runs = num_outputs;
+	sorter->current_file = output;
+	if (active_trace) {
+	    active_trace->sort_merge_passes += 1;
+	}
     }
 
-    ssize_t bytes_written = write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
-    
-    if (bytes_written == -1) {
-        printf("Error writing: %d\n", errno);
-	exit(EXIT_FAILURE);
+    sorter_merge(sorter, sorter->runs, sorter->num_runs, fan_in, buffer_rows, sink, NULL);
+    if (active_trace) {
+	active_trace->sort_merge_passes += 1;
     }
 }
 
-Cursor *table_start(Table *table) {
-    Cursor *cursor = table_find(table, 0);
-
-    void *node = get_page(table->pager, cursor->page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
-    cursor->end_of_table = (num_cells == 0);
-
-    return cursor;
-}
+/* 用小顶堆归并 runs。sink 不为空时输出到 sink，否则写到另一个临时文件的末尾，output 记录新的有序段 */
+void sorter_merge(Sorter *sorter, SortRun *runs, uint32_t num_runs, uint32_t fan_in, uint32_t buffer_rows,
+		  RowSink *sink, SortRun *output) {
+    /* 每一段在内存中只有当前的一行，heap 中的 row 指向它 */
+    uint8_t *heads = sorter->rows;
+    uint8_t *buffers = heads + (size_t)fan_in * ROW_SIZE;
+    uint8_t *write_buffer = buffers + (size_t)fan_in * buffer_rows * ROW_SIZE;
+    SortRunReader readers[num_runs];
+    SortEntry *heap = sorter->entries;
+    uint32_t num_entries = 0;
+    for (uint32_t i = 0; i < num_runs; i++) {
+	readers[i].run = runs[i];
+	readers[i].rows_read = 0;
+	readers[i].buffer = buffers + (size_t)i * buffer_rows * ROW_SIZE;
+	readers[i].buffered = 0;
+	readers[i].position = 0;
+	void *row = heads + (size_t)i * ROW_SIZE;
+	if (sorter_read_row(sorter, &(readers[i]), buffer_rows, row)) {
+	    heap[num_entries].prefix = sorter_prefix(sorter, row);
+	    heap[num_entries].row = row;
+	    num_entries += 1;
+	    sorter_sift_up(sorter, heap, num_entries - 1, -1);
+	}
+    }
 
-void cursor_advance(Cursor *cursor) {
-    uint32_t page_num = cursor->page_num;
-    void *node = get_page(cursor->table->pager, page_num);
+    uint32_t output_file = 1 - sorter->current_file;
+    if (output != NULL) {
+	output->offset = sorter->file_ends[output_file];
+	output->num_rows = 0;
+    }
+    uint32_t buffered = 0;
+    while (num_entries > 0) {
+	if (sink != NULL) {
+	    if (!row_sink_emit(sink, heap[0].row)) {
+		break;
+	    }
+	} else {
+	    memcpy(write_buffer + (size_t)buffered * ROW_SIZE, heap[0].row, ROW_SIZE);
+	    buffered += 1;
+	    output->num_rows += 1;
+	    if (buffered == buffer_rows) {
+		struct iovec iov = { write_buffer, (size_t)buffered * ROW_SIZE };
+		sorter_write_rows(sorter, output_file, &iov, 1);
+		buffered = 0;
+	    }
+	}
 
-    cursor->cell_num += 1;
-    if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
-        uint32_t next_page_num = *leaf_node_next_leaf(node);
-	if (next_page_num == 0) {
-	    cursor->end_of_table = true;
+	uint32_t run = ((uint8_t *)heap[0].row - heads) / ROW_SIZE;
+	if (sorter_read_row(sorter, &(readers[run]), buffer_rows, heap[0].row)) {
+	    heap[0].prefix = sorter_prefix(sorter, heap[0].row);
 	} else {
-	    cursor->page_num = next_page_num;
-	    cursor->cell_num = 0;
+	    num_entries -= 1;
+	    heap[0] = heap[num_entries];
 	}
+	sorter_sift_down(sorter, heap, num_entries, 0, -1);
     }
-}
 
-/* 获得一个 node 中键值对的个数的指针 */
-uint32_t *leaf_node_num_cells(void *node) {
-    return (uint32_t *)((char *)node + LEAF_NODE_NUM_CELLS_OFFSET);
+    if (buffered > 0) {
+	struct iovec iov = { write_buffer, (size_t)buffered * ROW_SIZE };
+	sorter_write_rows(sorter, output_file, &iov, 1);
+    }
 }
 
-/* 根据 node 和 cell_num 返回一个键值对的指针 */
-void *leaf_node_cell(void *node, uint32_t cell_num) {
-    return (char *)node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+/* 从有序段中读出下一行到 row，缓冲区读完时用一次 pread 读入 buffer_rows 行 */
+bool sorter_read_row(Sorter *sorter, SortRunReader *reader, uint32_t buffer_rows, void *row) {
+    if (reader->position == reader->buffered) {
+	if (reader->rows_read == reader->run.num_rows) {
+	    return false;
+	}
+	uint64_t remaining = reader->run.num_rows - reader->rows_read;
+	uint32_t count = remaining < buffer_rows ? remaining : buffer_rows;
+	off_t offset = reader->run.offset + reader->rows_read * ROW_SIZE;
+	int fd = fileno(sorter->files[sorter->current_file]);
+	if (pread(fd, reader->buffer, (size_t)count * ROW_SIZE, offset) != (ssize_t)count * ROW_SIZE) {
+	    printf("Error reading temporary file: %d\n", errno);
+	    exit(EXIT_FAILURE);
+	}
+	reader->rows_read += count;
+	reader->buffered = count;
+	reader->position = 0;
+    }
+    memcpy(row, reader->buffer + (size_t)reader->position * ROW_SIZE, ROW_SIZE);
+    reader->position += 1;
+    return true;
 }
 
-/* 根据 node 和 cell_num 返回一个键值对的键的指针 */
-uint32_t *leaf_node_key(void *node, uint32_t cell_num) {
-    return leaf_node_cell(node, cell_num);
-}
+/* 把内存中的记录排序后写入一个临时文件 */
+/* 把内存中的记录排序后追加到当前的临时文件，记录这一段的位置 */
+void sorter_spill(Sorter *sorter) {
+    qsort_r(sorter->entries, sorter->num_rows, sizeof(SortEntry), sorter_qsort_compare, sorter);
+
+    uint32_t file = sorter->current_file;
+    sorter_file(sorter, file);
+    SortRun run = { sorter->file_ends[file], sorter->num_rows };
+    struct iovec iov[SORT_WRITE_BATCH_ROWS];
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < sorter->num_rows; i++) {
+	iov[count].iov_base = sorter->entries[i].row;
+	iov[count].iov_len = ROW_SIZE;
+	count += 1;
+	if (count == SORT_WRITE_BATCH_ROWS || i + 1 == sorter->num_rows) {
+	    sorter_write_rows(sorter, file, iov, count);
+	    count = 0;
+	}
+    }
 
-/* 根据 node 和 cell_num 返回一个键值对的值的指针 */
-void *leaf_node_value(void *node, uint32_t cell_num) {
-    return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+    sorter->runs = realloc(sorter->runs, (sorter->num_runs + 1) * sizeof(SortRun));
+    sorter->runs[sorter->num_runs] = run;
+    sorter->num_runs += 1;
+    sorter->num_rows = 0;
+    if (active_trace) {
+	active_trace->sort_runs += 1;
+    }
 }
 
-/* 将 node 中键值对的个数设置为 0 */
-void initialize_leaf_node(void *node) {
-    set_node_type(node, NODE_LEAF);
-    set_node_root(node, false);
-    *leaf_node_num_cells(node) = 0;
-    *leaf_node_next_leaf(node) = 0;
+/* 返回 file 号临时文件的描述符，第一次使用时创建 */
+int sorter_file(Sorter *sorter, uint32_t file) {
+    if (sorter->files[file] == NULL) {
+	sorter->files[file] = tmpfile();
+	if (sorter->files[file] == NULL) {
+	    printf("Unable to create temporary file: %d\n", errno);
+	    exit(EXIT_FAILURE);
+	}
+    }
+    return fileno(sorter->files[file]);
 }
 
-void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value) {
-    void *node = get_page(cursor->table->pager, cursor->page_num);
-
-    uint32_t num_cells = *leaf_node_num_cells(node);
-    if (num_cells >= LEAF_NODE_MAX_CELLS) {
-        leaf_node_split_and_insert(cursor, key, value);
-	return;
+/* 追加到 file 号临时文件的末尾 */
+void sorter_write_rows(Sorter *sorter, uint32_t file, struct iovec *iov, uint32_t count) {
+    size_t length = 0;
+    for (uint32_t i = 0; i < count; i++) {
+	length += iov[i].iov_len;
     }
-
-    if (cursor->cell_num < num_cells) {
-        for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-	    memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1), LEAF_NODE_CELL_SIZE);
-	}
-     }
-    *(leaf_node_num_cells(node)) += 1;
-    *(leaf_node_key(node, cursor->cell_num)) = key;
-    serialize_row(value, leaf_node_value(node, cursor->cell_num));
+    ssize_t bytes_written = pwritev(sorter_file(sorter, file), iov, count, sorter->file_ends[file]);
+    if (bytes_written != (ssize_t)length) {
+	printf("Error writing: %d\n", errno);
+	exit(EXIT_FAILURE);
+    }
+    sorter->file_ends[file] += length;
 }
 
-/* 打印数据库信息 */
-void print_constants() {
-    printf("ROW_SIZE: %d\n", ROW_SIZE);
-    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+/* 字符串的前 8 个字节按大端序组成整数，比较结果与 strncmp 一致 */
+uint64_t sorter_prefix(Sorter *sorter, void *row) {
+    const uint8_t *string = row + sorter->offset;
+    uint64_t prefix = 0;
+    for (uint32_t i = 0; i < sizeof(uint64_t); i++) {
+	uint8_t byte = i < sorter->size ? string[i] : 0;
+	prefix = (prefix << 8) | byte;
+	if (byte == 0) {
+	    prefix <<= 8 * (sizeof(uint64_t) - 1 - i);
+	    break;
+	}
+    }
+    return prefix;
 }
 
-/* 返回对应键所在的游标 */
-Cursor *table_find(Table *table, uint32_t key) {
-    uint32_t root_page_num = table->root_page_num;
-    void *root_node = get_page(table->pager, root_page_num);
-
-    if (get_node_type(root_node) == NODE_LEAF) {
-        return leaf_node_find(table, root_page_num, key);
+/* 先比较排序列，相同时按 id 排序，结果是确定的 */
+int sorter_compare(Sorter *sorter, SortEntry *a, SortEntry *b) {
+    if (a->prefix != b->prefix) {
+	return a->prefix < b->prefix ? -1 : 1;
     }
-    return internal_node_find(table, root_page_num, key);
- }
-
- Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key) {
-    void *node = get_page(table->pager, page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
-
-    Cursor *cursor = malloc(sizeof(Cursor));
-    cursor->table = table;
-    cursor->page_num = page_num;
-    
-    // Binary search
-    uint32_t min_index = 0;
-    uint32_t one_past_max_index = num_cells;
-
-    while (min_index < one_past_max_index) {
-        uint32_t index = min_index + (one_past_max_index - min_index) / 2;
-	uint32_t key_at_index = *leaf_node_key(node, index);
-	if (key_at_index < key) {
-	    min_index = index + 1;
-	} else {
-	    one_past_max_index = index;
-	}
+    int result = strncmp(a->row + sorter->offset, b->row + sorter->offset, sorter->size);
+    if (result != 0) {
+	return result;
     }
 
-    cursor->cell_num = min_index;
-    return cursor;
+    uint32_t id_a, id_b;
+    memcpy(&id_a, a->row + ID_OFFSET, ID_SIZE);
+    memcpy(&id_b, b->row + ID_OFFSET, ID_SIZE);
+    return id_a < id_b ? -1 : id_a > id_b;
 }
 
-/* 获得节点的种类 */
-NodeType get_node_type(void* node) {
-    uint8_t value = *((uint8_t *)(node + NODE_TYPE_OFFSET));
-    return (NodeType)value;
+int sorter_qsort_compare(const void *a, const void *b, void *argument) {
+    return sorter_compare(argument, (SortEntry *)a, (SortEntry *)b);
 }
 
-/* 设置节点的种类 */
-void set_node_type(void *node, NodeType type) {
-    uint8_t value = type;
-    *((uint8_t*)(node + NODE_TYPE_OFFSET)) = value;
+/* sign 为 1 时是大顶堆，为 -1 时是小顶堆 */
+void sorter_sift_up(Sorter *sorter, SortEntry *heap, uint32_t index, int sign) {
+    while (index > 0) {
+	uint32_t parent = (index - 1) / 2;
+	if (sign * sorter_compare(sorter, &(heap[index]), &(heap[parent])) <= 0) {
+	    break;
+	}
+	SortEntry entry = heap[index];
+	heap[index] = heap[parent];
+	heap[parent] = entry;
+	index = parent;
+    }
 }
 
-/* 分割叶节点，并插入 */
-void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value) {
-    void *old_node = get_page(cursor->table->pager, cursor->page_num);
-    uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-    void *new_node = get_page(cursor->table->pager, new_page_num);
-    initialize_leaf_node(new_node);
-    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-    *leaf_node_next_leaf(old_node) = new_page_num;
-
-    /* 分割复制 */
-    for (int32_t i = LEAF_NODE_MAX_CELLS; i>=0; i--) {
-        void * destination_node;
-	if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
-	    destination_node = new_node;
-	} else {
-            destination_node = old_node;
+void sorter_sift_down(Sorter *sorter, SortEntry *heap, uint32_t num_entries, uint32_t index, int sign) {
+    while (true) {
+	uint32_t child = 2 * index + 1;
+	if (child >= num_entries) {
+	    break;
 	}
-
-	uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-	void* destination = leaf_node_cell(destination_node, index_within_node);
-	if (i == cursor->cell_num) {
-	    serialize_row(value, leaf_node_value(destination_node, index_within_node));
-	    *leaf_node_key(destination_node, index_within_node) = key;
-	} else if (i > cursor->cell_num) {
-	    memcpy(destination, leaf_node_cell(old_node,i - 1), LEAF_NODE_CELL_SIZE);
-	} else {
-	    memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+	if (child + 1 < num_entries && sign * sorter_compare(sorter, &(heap[child + 1]), &(heap[child])) > 0) {
+	    child += 1;
 	}
+	if (sign * sorter_compare(sorter, &(heap[child]), &(heap[index])) <= 0) {
+	    break;
+	}
+	SortEntry entry = heap[index];
+	heap[index] = heap[child];
+	heap[child] = entry;
+	index = child;
     }
+}
 
-    /* 更新两个节点的节点个数 */
-    *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+/* 按 % 的位置给 like 的模式分类，去掉两端的 % 后剩下的部分不含通配符时不需要通用的匹配 */
+void predicate_prepare_like(Predicate *predicate) {
+    const char *pattern = predicate->string;
+    uint32_t length = strlen(pattern);
+    uint32_t start = 0;
+    while (start < length && pattern[start] == '%') {
+	start += 1;
+    }
+    uint32_t end = length;
+    while (end > start && pattern[end - 1] == '%') {
+	end -= 1;
+    }
 
-    if (is_node_root(old_node)) {
-        return create_new_root(cursor->table, new_page_num);
+    predicate->like_offset = start;
+    predicate->like_length = end - start;
+    if (memchr(pattern + start, '%', end - start) != NULL || memchr(pattern + start, '_', end - start) != NULL) {
+	predicate->like_kind = LIKE_GENERAL;
+    } else if (start > 0 && end < length) {
+	predicate->like_kind = LIKE_CONTAINS;
+    } else if (start > 0) {
+	predicate->like_kind = LIKE_SUFFIX;
+    } else if (end < length) {
+	predicate->like_kind = LIKE_PREFIX;
     } else {
-        printf("Need to implement updating parent after split\n");
-	exit(EXIT_FAILURE);
+	predicate->like_kind = LIKE_EXACT;
     }
 }
 
-uint32_t get_unused_page_num(Pager *pager) {
+bool predicate_like(Predicate *predicate, const char *string, uint32_t size) {
+    const char *literal = predicate->string + predicate->like_offset;
+    uint32_t length = predicate->like_length;
+    switch (predicate->like_kind) {
+	case (LIKE_EXACT):
+	    return strncmp(string, predicate->string, size) == 0;
+	case (LIKE_PREFIX):
+	    return strncmp(string, literal, length) == 0;
+	case (LIKE_SUFFIX): {
+	    uint32_t string_length = strnlen(string, size);
+	    return string_length >= length && memcmp(string + string_length - length, literal, length) == 0;
+	}
+	case (LIKE_CONTAINS):
+	    return memmem(string, strnlen(string, size), literal, length) != NULL;
+	case (LIKE_GENERAL):
+	    return like_match(string, strnlen(string, size), predicate->string);
+    }
+    return false;
+}
+
+/* % 匹配任意个字符，_ 匹配一个字符。失配时回到最近的 % 多吞一个字符，不需要递归 */
+bool like_match(const char *text, uint32_t size, const char *pattern) {
+    uint32_t position = 0;
+    const char *star = NULL;
+    uint32_t star_position = 0;
+    while (position < size) {
+	if (*pattern == '%') {
+	    pattern += 1;
+	    star = pattern;
+	    star_position = position;
+	} else if (*pattern != '\0' && (*pattern == '_' || *pattern == text[position])) {
+	    pattern += 1;
+	    position += 1;
+	} else if (star != NULL) {
+	    pattern = star;
+	    star_position += 1;
+	    position = star_position;
+	} else {
+	    return false;
+	}
+    }
+    while (*pattern == '%') {
+	pattern += 1;
+    }
+    return *pattern == '\0';
+}
+
+/* 对一批记录求值条件，满足条件的下标写入 selection，返回个数。
+ * 循环中没有分支：总是写入下标，再按比较的结果决定是否保留，编译器可以把它向量化。 */
+uint32_t predicate_select(Predicate *predicate, void **values, uint32_t count, uint32_t *selection) {
+    uint32_t selected = 0;
+    if (!(predicate->enabled)) {
+	for (uint32_t i = 0; i < count; i++) {
+	    selection[i] = i;
+	}
+	return count;
+    }
+
+    if (predicate->column != COLUMN_ID) {
+	for (uint32_t i = 0; i < count; i++) {
+	    selection[selected] = i;
+	    selected += predicate_match(predicate, values[i]);
+	}
+	return selected;
+    }
+
+    uint32_t ids[VECTOR_BATCH_SIZE];
+    for (uint32_t i = 0; i < count; i++) {
+	memcpy(&(ids[i]), values[i] + ID_OFFSET, ID_SIZE);
+    }
+    if (predicate->op == COMPARE_NOT_EQUAL) {
+	for (uint32_t i = 0; i < count; i++) {
+	    selection[selected] = i;
+	    selected += ids[i] != predicate->id;
+	}
+	return selected;
+    }
+
+    /* 其余的比较都是闭区间 [low, high]，用一次无符号比较判断 id - low <= high - low */
+    uint32_t low = 0;
+    uint32_t high = UINT32_MAX;
+    switch (predicate->op) {
+	case (COMPARE_EQUAL):
+	    low = predicate->id;
+	    high = predicate->id;
+	    break;
+	case (COMPARE_LESS):
+	    if (predicate->id == 0) {
+		return 0;
+	    }
+	    high = predicate->id - 1;
+	    break;
+	case (COMPARE_LESS_EQUAL):
+	    high = predicate->id;
+	    break;
+	case (COMPARE_GREATER):
+	    if (predicate->id == UINT32_MAX) {
+		return 0;
+	    }
+	    low = predicate->id + 1;
+	    break;
+	case (COMPARE_GREATER_EQUAL):
+	    low = predicate->id;
+	    break;
+	default:
+	    break;
+    }
+    uint32_t width = high - low;
+    for (uint32_t i = 0; i < count; i++) {
+	selection[selected] = i;
+	selected += ids[i] - low <= width;
+    }
+    return selected;
+}
+
+bool predicate_match(Predicate *predicate, void *value) {
+    if (predicate->column != COLUMN_ID) {
+	uint32_t offset = predicate->column == COLUMN_USERNAME ? USERNAME_OFFSET : EMAIL_OFFSET;
+	uint32_t size = predicate->column == COLUMN_USERNAME ? USERNAME_SIZE : EMAIL_SIZE;
+	if (predicate->op == COMPARE_LIKE) {
+	    return predicate_like(predicate, value + offset, size);
+	}
+	bool equal = strncmp(value + offset, predicate->string, size) == 0;
+	return predicate->op == COMPARE_EQUAL ? equal : !equal;
+    }
+
+    uint32_t id;
+    memcpy(&id, value + ID_OFFSET, ID_SIZE);
+    switch (predicate->op) {
+	case (COMPARE_EQUAL):
+	    return id == predicate->id;
+	case (COMPARE_NOT_EQUAL):
+	    return id != predicate->id;
+	case (COMPARE_LESS):
+	    return id < predicate->id;
+	case (COMPARE_LESS_EQUAL):
+	    return id <= predicate->id;
+	case (COMPARE_GREATER):
+	    return id > predicate->id;
+	case (COMPARE_GREATER_EQUAL):
+	    return id >= predicate->id;
+	default:
+	    return false;
+    }
+}
+
+/* 记录按 id 递增，id 超过上界之后不会再有满足条件的记录 */
+bool predicate_exhausted(Predicate *predicate, void *value) {
+    if (predicate->column != COLUMN_ID) {
+	return false;
+    }
+
+    uint32_t id;
+    memcpy(&id, value + ID_OFFSET, ID_SIZE);
+    switch (predicate->op) {
+	case (COMPARE_EQUAL):
+	case (COMPARE_LESS_EQUAL):
+	    return id > predicate->id;
+	case (COMPARE_LESS):
+	    return id >= predicate->id;
+	default:
+	    return false;
+    }
+}
+
+void print_columns(FILE *out, void *value, Column *columns, uint32_t num_columns) {
+    fputc('(', out);
+    for (uint32_t i = 0; i < num_columns; i++) {
+        if (i > 0) {
+	    fputs(", ", out);
+	}
+	switch (columns[i]) {
+	    case (COLUMN_ID): {
+	        uint32_t id;
+		memcpy(&id, value + ID_OFFSET, ID_SIZE);
+		fprintf(out, "%d", id);
+		break;
+	    }
+	    case (COLUMN_USERNAME):
+	        fputs((char *)(value + USERNAME_OFFSET), out);
+		break;
+	    case (COLUMN_EMAIL):
+	        fputs((char *)(value + EMAIL_OFFSET), out);
+		break;
+	}
+    }
+    fputs(")\n", out);
+}
+
+void print_row(Row *row) {
+    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+}
+
+void serialize_row(Row *source, void *destination) {
+    memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
+    memcpy(destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
+    memcpy(destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
+}
+
+
+void deserialize_row(void *source, Row *destination) {
+    memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
+    memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
+    memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+}
+
+
+void *cursor_value(Cursor *cursor) {
+    uint64_t page_num = cursor->page_num;
+    /* 获得那一页的指针 */
+    void *page = get_page(cursor->table->pager, page_num);
+    return leaf_node_value(page, cursor->cell_num);
+}
+
+PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement) {
+    // 将声明置为插入语句
+    statement->type = STATEMENT_INSERT;
+
+    // strtok() 函数为不可重入函数，不安全，批处理模式下解析在单独的线程中进行，因此使用 strtok_r()。
+    char *saveptr;
+    char *keyword = strtok_r(input_buffer->buffer, " ", &saveptr);
+    char *id_string = strtok_r(NULL, " ", &saveptr);
+    char *username = strtok_r(NULL, " ", &saveptr);
+    char *email = strtok_r(NULL, " ", &saveptr);
+
+    if (id_string == NULL || username == NULL || email == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    int id = atoi(id_string);
+    if (id < 0) {
+        return PREPARE_NEGATIVE_ID;
+    }
+
+    if (strlen(username) > COLUMN_USERNAME_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+
+    if (strlen(email) > COLUMN_EMAIL_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+
+    statement->row_to_insert.id = id;
+    strcpy(statement->row_to_insert.username, username);
+    strcpy(statement->row_to_insert.email, email);
+
+    return PREPARE_SUCCESS;
+}
+
+/* select [列, ...] [where 列 运算符 值]，没有列或者列为 * 时输出所有列 */
+PrepareResult prepare_select(InputBuffer *input_buffer, Statement *statement) {
+    statement->type = STATEMENT_SELECT;
+    statement->num_columns = 0;
+    statement->where.enabled = false;
+
+    char *saveptr;
+    char *token = strtok_r(input_buffer->buffer, " ,", &saveptr);
+    token = strtok_r(NULL, " ,", &saveptr);
+    statement->num_aggregates = 0;
+    while (token != NULL && strcmp(token, "where") != 0 && strcmp(token, "order") != 0
+	   && strcmp(token, "limit") != 0 && strcmp(token, "group") != 0) {
+	if (strcmp(token, "*") == 0) {
+	    statement->num_columns = 0;
+	} else if (strchr(token, '(') != NULL || strcmp(token, "count") == 0) {
+	    if (statement->num_aggregates >= MAX_AGGREGATES
+		|| !parse_aggregate(token, &(statement->aggregates[statement->num_aggregates]))) {
+		return PREPARE_SYNTAX_ERROR;
+	    }
+	    statement->num_aggregates += 1;
+	} else if (statement->num_columns >= NUM_COLUMNS
+	           || !parse_column(token, &(statement->columns[statement->num_columns]))) {
+	    return PREPARE_SYNTAX_ERROR;
+	} else {
+	    statement->num_columns += 1;
+	}
+	token = strtok_r(NULL, " ,", &saveptr);
+    }
+
+    if (statement->num_columns == 0 && statement->num_aggregates == 0) {
+	statement->columns[0] = COLUMN_ID;
+	statement->columns[1] = COLUMN_USERNAME;
+	statement->columns[2] = COLUMN_EMAIL;
+	statement->num_columns = NUM_COLUMNS;
+    }
+
+    statement->has_order_by = false;
+    statement->has_limit = false;
+    statement->limit = 0;
+    if (token != NULL && strcmp(token, "where") == 0) {
+	PrepareResult result = prepare_where(&(statement->where), &saveptr);
+	if (result != PREPARE_SUCCESS) {
+	    return result;
+	}
+	token = strtok_r(NULL, " ", &saveptr);
+    }
+
+    statement->has_group_by = false;
+    if (token != NULL && strcmp(token, "group") == 0) {
+	token = strtok_r(NULL, " ", &saveptr);
+	char *column = strtok_r(NULL, " ", &saveptr);
+	if (token == NULL || strcmp(token, "by") != 0 || column == NULL
+	    || !parse_column(column, &(statement->group_by)) || statement->group_by == COLUMN_ID) {
+	    return PREPARE_SYNTAX_ERROR;
+	}
+	statement->has_group_by = true;
+	token = strtok_r(NULL, " ", &saveptr);
+    }
+
+    /* order by id 就是扫描的顺序，不需要排序 */
+    if (token != NULL && strcmp(token, "order") == 0) {
+	token = strtok_r(NULL, " ", &saveptr);
+	char *column = strtok_r(NULL, " ", &saveptr);
+	if (token == NULL || strcmp(token, "by") != 0 || column == NULL
+	    || !parse_column(column, &(statement->order_by))) {
+	    return PREPARE_SYNTAX_ERROR;
+	}
+	statement->has_order_by = statement->order_by != COLUMN_ID;
+	token = strtok_r(NULL, " ", &saveptr);
+    }
+
+    if (token != NULL && strcmp(token, "limit") == 0) {
+	char *limit = strtok_r(NULL, " ", &saveptr);
+	if (limit == NULL || atoi(limit) < 0) {
+	    return PREPARE_SYNTAX_ERROR;
+	}
+	statement->has_limit = true;
+	statement->limit = atoi(limit);
+	token = strtok_r(NULL, " ", &saveptr);
+    }
+
+    if (token != NULL) {
+	return PREPARE_SYNTAX_ERROR;
+    }
+
+    /* 分组按键的顺序输出，输出的列只能是分组的列 */
+    if (statement->num_aggregates > 0 || statement->has_group_by) {
+	for (uint32_t i = 0; i < statement->num_columns; i++) {
+	    if (!statement->has_group_by || statement->columns[i] != statement->group_by) {
+		return PREPARE_SYNTAX_ERROR;
+	    }
+	}
+	if (statement->has_order_by && (!statement->has_group_by || statement->order_by != statement->group_by)) {
+	    return PREPARE_SYNTAX_ERROR;
+	}
+	statement->has_order_by = false;
+    }
+    return PREPARE_SUCCESS;
+}
+
+/* where 列 运算符 值 */
+PrepareResult prepare_where(Predicate *where, char **saveptr) {
+    char *column = strtok_r(NULL, " ", saveptr);
+    char *op = strtok_r(NULL, " ", saveptr);
+    char *value = strtok_r(NULL, " ", saveptr);
+    if (column == NULL || op == NULL || value == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (!parse_column(column, &(where->column))) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (strcmp(op, "=") == 0) {
+	where->op = COMPARE_EQUAL;
+    } else if (strcmp(op, "!=") == 0) {
+	where->op = COMPARE_NOT_EQUAL;
+    } else if (strcmp(op, "<") == 0) {
+	where->op = COMPARE_LESS;
+    } else if (strcmp(op, "<=") == 0) {
+	where->op = COMPARE_LESS_EQUAL;
+    } else if (strcmp(op, ">") == 0) {
+	where->op = COMPARE_GREATER;
+    } else if (strcmp(op, ">=") == 0) {
+	where->op = COMPARE_GREATER_EQUAL;
+    } else if (strcmp(op, "like") == 0) {
+	where->op = COMPARE_LIKE;
+    } else {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (where->column == COLUMN_ID) {
+	if (where->op == COMPARE_LIKE) {
+	    return PREPARE_SYNTAX_ERROR;
+	}
+	int id = atoi(value);
+	if (id < 0) {
+	    return PREPARE_NEGATIVE_ID;
+	}
+	where->id = id;
+    } else if (where->op == COMPARE_LIKE) {
+	/* 模式中的 % 不占用列的长度，只受缓冲区的限制 */
+	value = strip_quotes(value);
+	if (strlen(value) > COLUMN_EMAIL_SIZE) {
+	    return PREPARE_STRING_TOO_LONG;
+	}
+	strcpy(where->string, value);
+	predicate_prepare_like(where);
+    } else {
+	if (where->op != COMPARE_EQUAL && where->op != COMPARE_NOT_EQUAL) {
+	    return PREPARE_SYNTAX_ERROR;
+	}
+	value = strip_quotes(value);
+	if (strlen(value) > (where->column == COLUMN_USERNAME ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE)) {
+	    return PREPARE_STRING_TOO_LONG;
+	}
+	strcpy(where->string, value);
+    }
+
+    where->enabled = true;
+    return PREPARE_SUCCESS;
+}
+
+bool parse_column(const char *name, Column *column) {
+    if (strcmp(name, "id") == 0) {
+	*column = COLUMN_ID;
+    } else if (strcmp(name, "username") == 0) {
+	*column = COLUMN_USERNAME;
+    } else if (strcmp(name, "email") == 0) {
+	*column = COLUMN_EMAIL;
+    } else {
+	return false;
+    }
+    return true;
+}
+
+/* 去掉字符串两边的单引号 */
+char *strip_quotes(char *token) {
+    size_t length = strlen(token);
+    if (length >= 2 && token[0] == '\'' && token[length - 1] == '\'') {
+	token[length - 1] = '\0';
+	return token + 1;
+    }
+    return token;
+}
+
+Table *db_open(const char *filename) {
+    if (file_has_magic(filename, CATALOG_FILE_MAGIC)) {
+        return catalog_open(filename);
+    }
+    if (file_has_magic(filename, LSM_FILE_MAGIC) || (pager_config.lsm && access(filename, F_OK) == -1)) {
+        return lsm_table_open(filename);
+    }
+
+    Pager *pager = pager_open(filename, pager_config.cow);
+
+    if (pager->num_pages > 0) {
+	/* 没有文件头的是旧格式的文件，先转换再重新打开。既不是新格式也不像旧格式的文件不能覆盖 */
+	void *header = get_page(pager, 0);
+	if (memcmp(header + HEADER_MAGIC_OFFSET, DB_FILE_MAGIC, HEADER_MAGIC_SIZE) != 0) {
+	    if (pager->cow || !legacy_file_valid(pager)) {
+		printf("Unsupported db file format.\n");
+		exit(EXIT_FAILURE);
+	    }
+	    pager_free(pager);
+	    db_migrate(filename);
+	    pager = pager_open(filename, pager_config.cow);
+	}
+    }
+
+    Table *table = malloc(sizeof(Table));
+    table->pager = pager;
+    table->filename = strdup(filename);
+    table->has_last_leaf = false;
+    table->hash_index = hash_index_new(HASH_INDEX_DEFAULT_MAX_ENTRIES);
+    table->num_partitions = 0;
+    table->lsm = NULL;
+
+    if (pager->num_pages == 0) {
+	initialize_header(get_page(pager, 0), 1);
+	void *root_node = get_page(pager, 1);
+	initialize_leaf_node(root_node);
+	set_node_root(root_node, true);
+    }
+
+    void *header = get_page(pager, 0);
+    if (*header_version(header) != DB_FORMAT_VERSION || *header_page_size(header) != PAGE_SIZE) {
+	printf("Unsupported db file format.\n");
+	exit(EXIT_FAILURE);
+    }
+    table->root_page_num = *header_root_page_num(header);
+
+    return table;
+}
+
+void *get_page(Pager* pager, uint64_t page_num) {
+    if (page_num >= TABLE_MAX_PAGES) {
+	printf("Tried to fetch page number out of bounds. %" PRIu64 " > %d\n", page_num, TABLE_MAX_PAGES);
+	exit(EXIT_FAILURE);
+    }
+
+    if (active_trace) {
+	trace_page(page_num, pager->pages[page_num] == NULL);
+    }
+
+    // 这里意味着只有当用的时候才将数据从磁盘当中读取出来
+    if (pager->pages[page_num] == NULL) {
+        // Cache miss. Allocate memory and load from file.
+	void *page = pager_alloc_frame(pager);
+	uint64_t num_pages = pager->file_length / PAGE_SIZE;
+
+	// We might save a partial page at the end of the file
+	if (pager->file_length % PAGE_SIZE) {
+	    num_pages += 1;
+	}
+
+	/* 写时复制模式下页面在文件中的位置由映射决定 */
+	uint64_t file_page = page_num;
+	if (pager->cow) {
+	    file_page = page_num < pager->num_pages ? pager->page_map[page_num] : COW_PAGE_NONE;
+	    num_pages = file_page == COW_PAGE_NONE ? 0 : file_page + 1;
+	}
+
+	// 如果小于意味可以从文件中读取出来
+	if (file_page < num_pages) {
+	    ssize_t bytes_read = pread(pager->file_descriptor, page, PAGE_SIZE, (off_t)file_page * PAGE_SIZE);
+	    if (bytes_read == -1) {
+	        printf("Error reading file: %d\n", errno);
+		exit(EXIT_FAILURE);
+	    }
+	    if (active_trace) {
+	        active_trace->read_calls += 1;
+		active_trace->pages_read += 1;
+	    }
+	}
+
+	pager->pages[page_num] = page;
+
+	if (page_num >= pager->num_pages) {
+	    for (uint64_t i = pager->num_pages; i <= page_num; i++) {
+		pager->page_map[i] = COW_PAGE_NONE;
+	    }
+	    pager->num_pages = page_num + 1;
+	}
+	if (pager->cow) {
+	    pager->page_fingerprints[page_num] = page_checksum(page, PAGE_SIZE);
+	}
+    }
+
+    return pager->pages[page_num];
+}
+
+/* cow 为 true 时新建的文件使用写时复制模式，已有的文件由元页面决定 */
+Pager* pager_open(const char *filename, bool cow) {
+    /* O_RDWR  -> Read/Write mode
+     * O_CREAT -> Create file if it does not exist
+     * S_IWUSR -> User write permission
+     * S_IRUSR -> User read permission */
+    /* 不能使用 O_APPEND，否则 pager_flush 无法覆盖已有的页面 */
+    int flags = O_RDWR | O_CREAT;
+    if (pager_config.direct_io) {
+	flags |= O_DIRECT;
+    }
+    int fd = open(filename, flags, S_IWUSR | S_IRUSR);
+
+    /* 有些文件系统（例如 tmpfs）不支持 O_DIRECT */
+    if (fd == -1 && pager_config.direct_io && errno == EINVAL) {
+	printf("O_DIRECT is not supported for '%s', using buffered I/O.\n", filename);
+	fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    }
+
+    if (fd == -1) {
+        printf("Unable to open file\n");
+	exit(EXIT_FAILURE);
+    }
+
+    off_t file_length = lseek(fd, 0, SEEK_END);
+
+    Pager *pager = calloc(1, sizeof(Pager));
+    pager->file_descriptor = fd;
+    pager->file_length = file_length;
+    pager->num_pages = (file_length / PAGE_SIZE);
+
+    if (file_length % PAGE_SIZE != 0) {
+        printf("Db file is not a whole number of pages. Corrupte file.\n");
+	exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+        pager->pages[i] = NULL;
+    }
+
+    /* 所有页面一次性分配。mmap 返回的地址按页对齐，满足 O_DIRECT 的要求。
+     * 申请不到大页时退回到普通页面，并建议内核使用透明大页。 */
+    pager->frames = MAP_FAILED;
+    if (pager_config.huge_pages) {
+	pager->frames_size = (TABLE_MAX_PAGES * PAGE_SIZE + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+	pager->frames = mmap(NULL, pager->frames_size, PROT_READ | PROT_WRITE,
+	                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (pager->frames == MAP_FAILED) {
+	pager->frames_size = TABLE_MAX_PAGES * PAGE_SIZE;
+	pager->frames = mmap(NULL, pager->frames_size, PROT_READ | PROT_WRITE,
+	                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pager->frames == MAP_FAILED) {
+	    printf("Unable to allocate page frames: %d\n", errno);
+	    exit(EXIT_FAILURE);
+	}
+	if (pager_config.huge_pages) {
+	    madvise(pager->frames, pager->frames_size, MADV_HUGEPAGE);
+	}
+    }
+
+    /* 编号小的页框先分配 */
+    pager->num_free_frames = TABLE_MAX_PAGES;
+    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+	pager->free_frames[i] = TABLE_MAX_PAGES - 1 - i;
+    }
+
+    /* 有元页面的文件使用写时复制模式。在读者表中登记之后，这个版本的页面不会被其他进程覆盖 */
+    pager->cow = false;
+    pager->lock_fd = -1;
+    pager->readers = NULL;
+    pager->write_locked = false;
+    void *meta = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+    bool has_magic = false;
+    for (uint32_t slot = 0; slot < COW_META_PAGES; slot++) {
+	pager_read_meta(pager, slot, meta);
+	has_magic = has_magic || memcmp(meta, COW_FILE_MAGIC, 8) == 0;
+    }
+    free(meta);
+
+    if (has_magic) {
+	pager->cow = true;
+	cow_lock_open(pager, filename);
+	cow_lock(pager);
+	if (!pager_load_newest_meta(pager)) {
+	    printf("No valid meta page. Corrupt file.\n");
+	    exit(EXIT_FAILURE);
+	}
+	cow_reader_register(pager);
+	cow_unlock(pager);
+    } else if (cow && file_length == 0) {
+	/* 先写入一个空的元页面，这样提交之前崩溃也能识别出文件的格式 */
+	pager->cow = true;
+	pager->meta_slot = 0;
+	pager->txn_id = 0;
+	pager_write_meta(pager, 0, 0, pager->page_map);
+	cow_lock_open(pager, filename);
+	cow_lock(pager);
+	cow_reader_register(pager);
+	cow_unlock(pager);
+    }
+
+    return pager;
+}
+
+/* 使用两个元页面中有效的、编号较大的那一个，另一个可能是写到一半的提交。没有有效的元页面时返回 false */
+bool pager_load_newest_meta(Pager *pager) {
+    void *meta = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+    bool valid[COW_META_PAGES];
+    uint64_t txn_ids[COW_META_PAGES];
+    for (uint32_t slot = 0; slot < COW_META_PAGES; slot++) {
+	valid[slot] = pager_read_meta(pager, slot, meta);
+	memcpy(&(txn_ids[slot]), meta + COW_META_TXN_ID_OFFSET, sizeof(uint64_t));
+    }
+    if (!valid[0] && !valid[1]) {
+	free(meta);
+	return false;
+    }
+
+    uint32_t slot = !valid[0] || (valid[1] && txn_ids[1] > txn_ids[0]) ? 1 : 0;
+    pager_read_meta(pager, slot, meta);
+    pager->meta_slot = slot;
+    pager->txn_id = txn_ids[slot];
+    memcpy(&(pager->num_pages), meta + COW_META_NUM_PAGES_OFFSET, sizeof(uint64_t));
+    memcpy(pager->page_map, meta + COW_META_PAGE_MAP_OFFSET, pager->num_pages * sizeof(uint64_t));
+    free(meta);
+    return true;
+}
+
+/* 打开（必要时创建）读者表文件并映射到内存中 */
+void cow_lock_open(Pager *pager, const char *filename) {
+    char *lock_filename = temp_filename(filename, COW_LOCK_FILE_SUFFIX);
+    pager->lock_fd = open(lock_filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    free(lock_filename);
+    if (pager->lock_fd == -1) {
+	printf("Unable to open lock file: %d\n", errno);
+	exit(EXIT_FAILURE);
+    }
+
+    /* 新建的文件长度为 0，扩展之后的内容都是 0，即所有槽位空闲 */
+    struct stat st;
+    if (fstat(pager->lock_fd, &st) == -1
+	|| (st.st_size < (off_t)sizeof(CowReaderTable) && ftruncate(pager->lock_fd, sizeof(CowReaderTable)) == -1)) {
+	printf("Unable to initialize lock file: %d\n", errno);
+	exit(EXIT_FAILURE);
+    }
+    pager->readers = mmap(NULL, sizeof(CowReaderTable), PROT_READ | PROT_WRITE, MAP_SHARED, pager->lock_fd, 0);
+    if (pager->readers == MAP_FAILED) {
+	printf("Unable to map lock file: %d\n", errno);
+	exit(EXIT_FAILURE);
+    }
+}
+
+void cow_lock(Pager *pager) {
+    while (flock(pager->lock_fd, LOCK_EX) == -1) {
+	if (errno != EINTR) {
+	    printf("Unable to lock db file: %d\n", errno);
+	    exit(EXIT_FAILURE);
+	}
+    }
+}
+
+void cow_unlock(Pager *pager) {
+    flock(pager->lock_fd, LOCK_UN);
+}
+
+/* 占用一个空闲的或者进程已经退出的槽位，调用时持有锁 */
+void cow_reader_register(Pager *pager) {
+    for (uint32_t i = 0; i < COW_MAX_READERS; i++) {
+	CowReader *reader = &(pager->readers->readers[i]);
+	if (!cow_reader_alive(reader)) {
+	    reader->pid = getpid();
+	    pager->reader_slot = i;
+	    cow_reader_publish(pager);
+	    return;
+	}
+    }
+    printf("Too many processes have the db file open.\n");
+    exit(EXIT_FAILURE);
+}
+
+/* 把当前读取的版本写入自己的槽位，调用时持有锁 */
+void cow_reader_publish(Pager *pager) {
+    CowReader *reader = &(pager->readers->readers[pager->reader_slot]);
+    reader->txn_id = pager->txn_id;
+    reader->num_pages = pager->num_pages;
+    memcpy(reader->page_map, pager->page_map, pager->num_pages * sizeof(uint64_t));
+}
+
+bool cow_reader_alive(CowReader *reader) {
+    if (reader->pid == 0) {
+	return false;
+    }
+    if (kill(reader->pid, 0) == -1 && errno == ESRCH) {
+	reader->pid = 0;
+	return false;
+    }
+    return true;
+}
+
+/* 临时文件改名之后，它的读者表不会再被使用 */
+void cow_remove_lock_file(const char *filename) {
+    char *lock_filename = temp_filename(filename, COW_LOCK_FILE_SUFFIX);
+    unlink(lock_filename);
+    free(lock_filename);
+}
+
+/* 开始修改之前取得写锁，直到提交结束。其他进程已经提交了更新的版本时丢弃缓存，切换到最新的版本，返回 true */
+bool pager_begin_write(Pager *pager) {
+    if (!(pager->cow) || pager->write_locked) {
+	return false;
+    }
+    cow_lock(pager);
+    pager->write_locked = true;
+
+    uint64_t txn_id = pager->txn_id;
+    uint64_t num_pages = pager->num_pages;
+    if (!pager_load_newest_meta(pager)) {
+	printf("No valid meta page. Corrupt file.\n");
+	exit(EXIT_FAILURE);
+    }
+    if (pager->txn_id == txn_id) {
+	pager->num_pages = num_pages;
+	return false;
+    }
+
+    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+	if (pager->pages[i] != NULL) {
+	    pager_release_frame(pager, pager->pages[i]);
+	    pager->pages[i] = NULL;
+	}
+    }
+    cow_reader_publish(pager);
+    return true;
+}
+
+/* 切换到最新的版本后，表中缓存的根节点、最近插入的叶子和哈希索引都已失效 */
+void db_begin_write(Table *table) {
+    if (!pager_begin_write(table->pager)) {
+	return;
+    }
+    table->root_page_num = *header_root_page_num(get_page(table->pager, 0));
+    table->has_last_leaf = false;
+    if (table->hash_index != NULL) {
+	hash_index_reset(table->hash_index);
+    }
+}
+
+void db_close(Table *table) {
+    if (table->num_partitions > 0) {
+        for (uint32_t i = 0; i < table->num_partitions; i++) {
+	    db_close(table->partitions[i]);
+	}
+    } else if (table->lsm != NULL) {
+	lsm_close(table->lsm);
+    } else {
+        pager_close(table->pager);
+	hash_index_free(table->hash_index);
+    }
+    free(table->filename);
+    free(table);
+}
+
+/* 将缓存中的页面写回磁盘，然后关闭文件 */
+void pager_close(Pager *pager) {
+    // 存放整数页
+    pager_flush_all(pager);
+
+    pager_free(pager);
+}
+
+/* 关闭文件并释放缓存，不写回任何页面 */
+void pager_free(Pager *pager) {
+    // 关闭文件
+    int result = close(pager->file_descriptor);
+    if (result == -1) {
+        printf("Error closing db file.\n");
+	exit(EXIT_FAILURE);
+    }
+
+    /* 释放读者表中的槽位，同时释放写锁 */
+    if (pager->readers != NULL) {
+	cow_lock(pager);
+	pager->readers->readers[pager->reader_slot].pid = 0;
+	munmap(pager->readers, sizeof(CowReaderTable));
+	close(pager->lock_fd);
+    }
+
+    // 释放空间，所有页面都在页框区中，一次归还
+    munmap(pager->frames, pager->frames_size);
+    free(pager);
+}
+
+/* FNV-1a，每次处理 8 个字节。用作元页面的校验和以及页面内容的指纹 */
+uint64_t page_checksum(const void *data, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+	uint64_t word;
+	memcpy(&word, bytes + i, sizeof(uint64_t));
+	hash = (hash ^ word) * 1099511628211ULL;
+    }
+    for (size_t i = size / sizeof(uint64_t) * sizeof(uint64_t); i < size; i++) {
+	hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* 读取 slot 号元页面，返回它是否完整有效 */
+bool pager_read_meta(Pager *pager, uint32_t slot, void *meta) {
+    memset(meta, 0, PAGE_SIZE);
+    ssize_t bytes_read = pread(pager->file_descriptor, meta, PAGE_SIZE, (off_t)slot * PAGE_SIZE);
+    if (bytes_read != PAGE_SIZE || memcmp(meta, COW_FILE_MAGIC, 8) != 0) {
+	return false;
+    }
+
+    uint32_t version, page_size;
+    uint64_t num_pages, checksum;
+    memcpy(&version, meta + 8, sizeof(uint32_t));
+    memcpy(&page_size, meta + 12, sizeof(uint32_t));
+    memcpy(&num_pages, meta + COW_META_NUM_PAGES_OFFSET, sizeof(uint64_t));
+    memcpy(&checksum, meta + COW_META_CHECKSUM_OFFSET, sizeof(uint64_t));
+    if (version != COW_FORMAT_VERSION || page_size != PAGE_SIZE || num_pages > TABLE_MAX_PAGES) {
+	return false;
+    }
+    for (uint64_t i = 0; i < num_pages; i++) {
+	uint64_t file_page;
+	memcpy(&file_page, meta + COW_META_PAGE_MAP_OFFSET + i * sizeof(uint64_t), sizeof(uint64_t));
+	if (file_page >= COW_MAX_FILE_PAGES) {
+	    return false;
+	}
+    }
+
+    /* 校验和不包括校验和字段本身 */
+    memset(meta + COW_META_CHECKSUM_OFFSET, 0, sizeof(uint64_t));
+    bool valid = page_checksum(meta, COW_META_PAGE_MAP_OFFSET + num_pages * sizeof(uint64_t)) == checksum;
+    memcpy(meta + COW_META_CHECKSUM_OFFSET, &checksum, sizeof(uint64_t));
+    return valid;
+}
+
+/* 写入 slot 号元页面并等待它落盘，之后这次提交才算完成 */
+void pager_write_meta(Pager *pager, uint32_t slot, uint64_t txn_id, uint64_t *page_map) {
+    void *meta = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+    memset(meta, 0, PAGE_SIZE);
+
+    uint32_t version = COW_FORMAT_VERSION;
+    uint32_t page_size = PAGE_SIZE;
+    memcpy(meta, COW_FILE_MAGIC, 8);
+    memcpy(meta + 8, &version, sizeof(uint32_t));
+    memcpy(meta + 12, &page_size, sizeof(uint32_t));
+    memcpy(meta + COW_META_TXN_ID_OFFSET, &txn_id, sizeof(uint64_t));
+    memcpy(meta + COW_META_NUM_PAGES_OFFSET, &(pager->num_pages), sizeof(uint64_t));
+    memcpy(meta + COW_META_PAGE_MAP_OFFSET, page_map, pager->num_pages * sizeof(uint64_t));
+    uint64_t checksum = page_checksum(meta, COW_META_PAGE_MAP_OFFSET + pager->num_pages * sizeof(uint64_t));
+    memcpy(meta + COW_META_CHECKSUM_OFFSET, &checksum, sizeof(uint64_t));
+
+    if (pwrite(pager->file_descriptor, meta, PAGE_SIZE, (off_t)slot * PAGE_SIZE) != PAGE_SIZE
+	|| fdatasync(pager->file_descriptor) == -1) {
+	printf("Error writing meta page: %d\n", errno);
+	exit(EXIT_FAILURE);
+    }
+    free(meta);
+
+    if ((slot + 1) * (uint64_t)PAGE_SIZE > pager->file_length) {
+	pager->file_length = (slot + 1) * (uint64_t)PAGE_SIZE;
+    }
+}
+
+/* 把内容改变了的页面写到上一次提交和所有读者都没有使用的位置，等它们落盘之后再写入另一个元页面。
+ * 被替换下来的旧位置在没有读者使用它之后才会被重新使用。 */
+void pager_commit(Pager *pager) {
+    if (!(pager->write_locked)) {
+	cow_lock(pager);
+	pager->write_locked = true;
+    }
+
+    bool in_use[COW_MAX_FILE_PAGES];
+    memset(in_use, 0, sizeof(in_use));
+    for (uint32_t i = 0; i < COW_META_PAGES; i++) {
+	in_use[i] = true;
+    }
+    for (uint64_t page_num = 0; page_num < pager->num_pages; page_num++) {
+	if (pager->page_map[page_num] != COW_PAGE_NONE) {
+	    in_use[pager->page_map[page_num]] = true;
+	}
+    }
+    for (uint32_t i = 0; i < COW_MAX_READERS; i++) {
+	CowReader *reader = &(pager->readers->readers[i]);
+	if (!cow_reader_alive(reader)) {
+	    continue;
+	}
+	for (uint64_t page_num = 0; page_num < reader->num_pages && page_num < TABLE_MAX_PAGES; page_num++) {
+	    if (reader->page_map[page_num] < COW_MAX_FILE_PAGES) {
+		in_use[reader->page_map[page_num]] = true;
+	    }
+	}
+    }
+
+    uint64_t new_map[TABLE_MAX_PAGES];
+    memcpy(new_map, pager->page_map, pager->num_pages * sizeof(uint64_t));
+    uint64_t new_fingerprints[TABLE_MAX_PAGES];
+    uint64_t next_free = COW_META_PAGES;
+    bool changed = false;
+
+    struct iovec iov[PAGER_WRITE_BATCH_PAGES];
+    uint32_t count = 0;
+    uint64_t run_start = 0;
+    for (uint64_t page_num = 0; page_num <= pager->num_pages; page_num++) {
+	uint64_t file_page = COW_PAGE_NONE;
+	if (page_num < pager->num_pages && pager->pages[page_num] != NULL) {
+	    new_fingerprints[page_num] = page_checksum(pager->pages[page_num], PAGE_SIZE);
+	    if (new_fingerprints[page_num] != pager->page_fingerprints[page_num]
+		|| pager->page_map[page_num] == COW_PAGE_NONE) {
+		while (next_free < COW_MAX_FILE_PAGES && in_use[next_free]) {
+		    next_free += 1;
+		}
+		if (next_free == COW_MAX_FILE_PAGES) {
+		    printf("Db file is full.\n");
+		    exit(EXIT_FAILURE);
+		}
+		file_page = next_free;
+		in_use[file_page] = true;
+		new_map[page_num] = file_page;
+		changed = true;
+	    }
+	}
+
+	/* 文件中位置相邻的页面合并为一次 pwritev */
+	if (count > 0 && (file_page != run_start + count || count == PAGER_WRITE_BATCH_PAGES)) {
+	    ssize_t bytes_written = pwritev(pager->file_descriptor, iov, count, (off_t)run_start * PAGE_SIZE);
+	    if (bytes_written != (ssize_t)count * PAGE_SIZE) {
+		printf("Error writing: %d\n", errno);
+		exit(EXIT_FAILURE);
+	    }
+	    if ((run_start + count) * PAGE_SIZE > pager->file_length) {
+		pager->file_length = (run_start + count) * PAGE_SIZE;
+	    }
+	    count = 0;
+	}
+	if (file_page != COW_PAGE_NONE) {
+	    if (count == 0) {
+		run_start = file_page;
+	    }
+	    iov[count].iov_base = pager->pages[page_num];
+	    iov[count].iov_len = PAGE_SIZE;
+	    count += 1;
+	}
+    }
+
+    if (!changed) {
+	pager->write_locked = false;
+	cow_unlock(pager);
+	return;
+    }
+
+    if (fdatasync(pager->file_descriptor) == -1) {
+	printf("Error syncing db file: %d\n", errno);
+	exit(EXIT_FAILURE);
+    }
+    uint32_t slot = 1 - pager->meta_slot;
+    pager_write_meta(pager, slot, pager->txn_id + 1, new_map);
+
+    pager->txn_id += 1;
+    pager->meta_slot = slot;
+    memcpy(pager->page_map, new_map, pager->num_pages * sizeof(uint64_t));
+    for (uint64_t page_num = 0; page_num < pager->num_pages; page_num++) {
+	if (pager->pages[page_num] != NULL) {
+	    pager->page_fingerprints[page_num] = new_fingerprints[page_num];
+	}
+    }
+    cow_reader_publish(pager);
+    pager->write_locked = false;
+    cow_unlock(pager);
+}
+
+/* 写时复制模式下提交修改，普通模式下页面仍然只在关闭时写回 */
+void db_commit(Table *table) {
+    if (table->num_partitions > 0) {
+	for (uint32_t i = 0; i < table->num_partitions; i++) {
+	    db_commit(table->partitions[i]);
+	}
+    } else if (table->pager != NULL && table->pager->cow) {
+	pager_commit(table->pager);
+    }
+}
+
+void *pager_alloc_frame(Pager *pager) {
+    if (pager->num_free_frames == 0) {
+	printf("Out of page frames.\n");
+	exit(EXIT_FAILURE);
+    }
+
+    pager->num_free_frames -= 1;
+    uint32_t frame = pager->free_frames[pager->num_free_frames];
+    return pager->frames + (size_t)frame * PAGE_SIZE;
+}
+
+void pager_release_frame(Pager *pager, void *frame) {
+    pager->free_frames[pager->num_free_frames] = (frame - pager->frames) / PAGE_SIZE;
+    pager->num_free_frames += 1;
+}
+
+void pager_flush(Pager *pager, uint64_t page_num) {
+    // 存空页则报错
+    if (pager->pages[page_num] == NULL) {
+        printf("Tried to flush null page\n");
+	exit(EXIT_FAILURE);
+    }
+
+    /* pwrite 不移动文件偏移量，页号先转换为 64 位再计算偏移 */
+    ssize_t bytes_written = pwrite(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE, (off_t)page_num * PAGE_SIZE);
+    
+    if (bytes_written == -1) {
+        printf("Error writing: %d\n", errno);
+	exit(EXIT_FAILURE);
+    }
+}
+
+/* 将缓存中的页面写回磁盘，页号相邻的页面合并为一次 pwritev */
+void pager_flush_all(Pager *pager) {
+    /* 写时复制模式下不能覆盖原来的页面 */
+    if (pager->cow) {
+	pager_commit(pager);
+	return;
+    }
+
+    struct iovec iov[PAGER_WRITE_BATCH_PAGES];
+    uint64_t page_num = 0;
+
+    while (page_num < pager->num_pages) {
+	if (pager->pages[page_num] == NULL) {
+	    page_num += 1;
+	    continue;
+	}
+
+	uint32_t count = 0;
+	while (count < PAGER_WRITE_BATCH_PAGES && page_num + count < pager->num_pages
+	       && pager->pages[page_num + count] != NULL) {
+	    iov[count].iov_base = pager->pages[page_num + count];
+	    iov[count].iov_len = PAGE_SIZE;
+	    count += 1;
+	}
+
+	ssize_t bytes_written = pwritev(pager->file_descriptor, iov, count, (off_t)page_num * PAGE_SIZE);
+	if (bytes_written == -1) {
+	    printf("Error writing: %d\n", errno);
+	    exit(EXIT_FAILURE);
+	}
+
+	/* 没有写完的页面逐个写回 */
+	for (uint32_t i = bytes_written / PAGE_SIZE; i < count; i++) {
+	    pager_flush(pager, page_num + i);
+	}
+	page_num += count;
+    }
+}
+
+/* 从 page_num 开始，把文件中连续的、还不在缓存中的页面用一次 preadv 读入 */
+void pager_read_ahead(Pager *pager, uint64_t page_num) {
+    struct iovec iov[PAGER_READ_AHEAD_PAGES];
+    uint64_t file_pages = pager->file_length / PAGE_SIZE;
+
+    /* 写时复制模式下只有在文件中也相邻的页面才能一起读入 */
+    uint64_t file_page = page_num;
+    if (pager->cow) {
+	if (page_num >= pager->num_pages || pager->page_map[page_num] == COW_PAGE_NONE) {
+	    return;
+	}
+	file_page = pager->page_map[page_num];
+    }
+
+    uint32_t count = 0;
+    while (count < PAGER_READ_AHEAD_PAGES && file_page + count < file_pages
+	   && page_num + count < TABLE_MAX_PAGES && pager->pages[page_num + count] == NULL
+	   && (!(pager->cow) || (page_num + count < pager->num_pages
+				 && pager->page_map[page_num + count] == file_page + count))) {
+	iov[count].iov_base = pager_alloc_frame(pager);
+	iov[count].iov_len = PAGE_SIZE;
+	count += 1;
+    }
+    if (count == 0) {
+	return;
+    }
+
+    ssize_t bytes_read = preadv(pager->file_descriptor, iov, count, (off_t)file_page * PAGE_SIZE);
+    if (bytes_read == -1) {
+	printf("Error reading file: %d\n", errno);
+	exit(EXIT_FAILURE);
+    }
+    if (active_trace) {
+	active_trace->read_calls += 1;
+	active_trace->pages_read += bytes_read / PAGE_SIZE;
+    }
+
+    /* 只保留完整读入的页面，其余的留给 get_page 再读。预读的页面也是从磁盘读入的，记为未命中 */
+    for (uint32_t i = 0; i < count; i++) {
+	if ((i + 1) * PAGE_SIZE <= bytes_read) {
+	    pager->pages[page_num + i] = iov[i].iov_base;
+	    if (active_trace) {
+		trace_page(page_num + i, true);
+	    }
+	    if (pager->cow) {
+		pager->page_fingerprints[page_num + i] = page_checksum(iov[i].iov_base, PAGE_SIZE);
+	    }
+	} else {
+	    pager_release_frame(pager, iov[i].iov_base);
+	}
+    }
+    if (page_num + count > pager->num_pages) {
+	pager->num_pages = page_num + count;
+    }
+}
+
+Cursor *table_start(Table *table) {
+    return table_lower_bound(table, 0);
+}
+
+Cursor *table_lower_bound(Table *table, uint32_t key) {
+    Cursor *cursor = table_find(table, key);
+
+    /* key 比叶子中所有的键都大时，第一条记录在下一个叶子中 */
+    void *node = get_page(table->pager, cursor->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (cursor->cell_num >= num_cells) {
+	uint64_t next_page_num = *leaf_node_next_leaf(node);
+	if (next_page_num == 0) {
+	    cursor->end_of_table = true;
+	} else {
+	    cursor->page_num = next_page_num;
+	    cursor->cell_num = 0;
+	}
+    }
+
+    return cursor;
+}
+
+void cursor_advance(Cursor *cursor) {
+    uint64_t page_num = cursor->page_num;
+    void *node = get_page(cursor->table->pager, page_num);
+
+    cursor->cell_num += 1;
+    if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
+	uint64_t next_page_num = *leaf_node_next_leaf(node);
+	if (next_page_num == 0) {
+	    cursor->end_of_table = true;
+	} else {
+	    /* 叶子不在缓存中时，顺带读入其后连续的页面 */
+	    if (next_page_num < TABLE_MAX_PAGES && cursor->table->pager->pages[next_page_num] == NULL) {
+	        pager_read_ahead(cursor->table->pager, next_page_num);
+	    }
+	    cursor->page_num = next_page_num;
+	    cursor->cell_num = 0;
+	    if (active_trace) {
+	        active_trace->leaves_walked += 1;
+	    }
+	}
+    }
+}
+
+/* 获得一个 node 中键值对的个数的指针 */
+uint32_t *leaf_node_num_cells(void *node) {
+    return (uint32_t *)((char *)node + LEAF_NODE_NUM_CELLS_OFFSET);
+}
+
+/* 根据 node 和 cell_num 返回一个键值对的指针 */
+void *leaf_node_cell(void *node, uint32_t cell_num) {
+    return (char *)node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+}
+
+/* 根据 node 和 cell_num 返回一个键值对的键的指针 */
+uint32_t *leaf_node_key(void *node, uint32_t cell_num) {
+    return leaf_node_cell(node, cell_num);
+}
+
+/* 根据 node 和 cell_num 返回一个键值对的值的指针 */
+void *leaf_node_value(void *node, uint32_t cell_num) {
+    return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+}
+
+/* 将 node 中键值对的个数设置为 0 */
+void initialize_leaf_node(void *node) {
+    set_node_type(node, NODE_LEAF);
+    set_node_root(node, false);
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_next_leaf(node) = 0;
+}
+
+void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value) {
+    void *node = get_page(cursor->table->pager, cursor->page_num);
+
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (num_cells >= LEAF_NODE_MAX_CELLS) {
+        leaf_node_split_and_insert(cursor, key, value);
+	return;
+    }
+
+    if (cursor->cell_num < num_cells) {
+        for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
+	    memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1), LEAF_NODE_CELL_SIZE);
+	}
+     }
+    *(leaf_node_num_cells(node)) += 1;
+    *(leaf_node_key(node, cursor->cell_num)) = key;
+    serialize_row(value, leaf_node_value(node, cursor->cell_num));
+    hash_index_invalidate(cursor->table, cursor->page_num);
+
+    cursor->table->has_last_leaf = true;
+    cursor->table->last_leaf_page_num = cursor->page_num;
+}
+
+/* 打印数据库信息 */
+void print_constants() {
+    printf("ROW_SIZE: %d\n", ROW_SIZE);
+    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
+    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+}
+
+/* 返回对应键所在的游标 */
+Cursor *table_find(Table *table, uint32_t key) {
+    Cursor *cursor = malloc(sizeof(Cursor));
+    table_seek(table, key, cursor);
+    return cursor;
+}
+
+/* 与 table_find 相同，但游标由调用者提供 */
+void table_seek(Table *table, uint32_t key, Cursor *cursor) {
+    uint64_t root_page_num = table->root_page_num;
+    void *root_node = get_page(table->pager, root_page_num);
+
+    if (get_node_type(root_node) == NODE_LEAF) {
+	leaf_node_find(table, root_page_num, key, cursor);
+    } else {
+	internal_node_find(table, root_page_num, key, cursor);
+    }
+}
+
+bool table_seek_hint(Table *table, uint32_t key, Cursor *cursor) {
+    if (!table->has_last_leaf) {
+	return false;
+    }
+
+    void *node = get_page(table->pager, table->last_leaf_page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (num_cells == 0 || key < *leaf_node_key(node, 0)) {
+	return false;
+    }
+
+    /* 最右边的叶子包含所有更大的键，追加时直接定位到末尾 */
+    uint32_t max_key = *leaf_node_key(node, num_cells - 1);
+    if (key > max_key) {
+	if (*leaf_node_next_leaf(node) != 0) {
+	    return false;
+	}
+	if (active_trace) {
+	    active_trace->nodes_visited += 1;
+	}
+	cursor->table = table;
+	cursor->page_num = table->last_leaf_page_num;
+	cursor->cell_num = num_cells;
+	cursor->end_of_table = false;
+	return true;
+    }
+
+    leaf_node_find(table, table->last_leaf_page_num, key, cursor);
+    return true;
+}
+
+void leaf_node_find(Table *table, uint64_t page_num, uint32_t key, Cursor *cursor) {
+    void *node = get_page(table->pager, page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (active_trace) {
+	active_trace->nodes_visited += 1;
+    }
+
+    cursor->table = table;
+    cursor->page_num = page_num;
+    cursor->end_of_table = false;
+    
+    // Binary search
+    uint32_t min_index = 0;
+    uint32_t one_past_max_index = num_cells;
+
+    while (min_index < one_past_max_index) {
+        uint32_t index = min_index + (one_past_max_index - min_index) / 2;
+	uint32_t key_at_index = *leaf_node_key(node, index);
+	if (key_at_index < key) {
+	    min_index = index + 1;
+	} else {
+	    one_past_max_index = index;
+	}
+    }
+
+    cursor->cell_num = min_index;
+}
+
+/* 获得节点的种类 */
+NodeType get_node_type(void* node) {
+    uint8_t value = *((uint8_t *)(node + NODE_TYPE_OFFSET));
+    return (NodeType)value;
+}
+
+/* 设置节点的种类 */
+void set_node_type(void *node, NodeType type) {
+    uint8_t value = type;
+    *((uint8_t*)(node + NODE_TYPE_OFFSET)) = value;
+}
+
+/* 分割叶节点，并插入 */
+void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value) {
+    if (active_trace) {
+	active_trace->splits += 1;
+    }
+    Table *table = cursor->table;
+    void *old_node = get_page(table->pager, cursor->page_num);
+    uint32_t old_max = get_node_max_key(old_node);
+    hash_index_invalidate(table, cursor->page_num);
+    uint64_t new_page_num = get_unused_page_num(table->pager);
+    void *new_node = get_page(table->pager, new_page_num);
+    initialize_leaf_node(new_node);
+    *node_parent(new_node) = *node_parent(old_node);
+    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+    *leaf_node_next_leaf(old_node) = new_page_num;
+
+    /* 在最右边的叶子末尾追加时，旧节点保持全满，新节点只放新的键。
+     * 键基本递增时叶子几乎都是满的。 */
+    uint32_t left_split_count = LEAF_NODE_LEFT_SPLIT_COUNT;
+    uint32_t right_split_count = LEAF_NODE_RIGHT_SPLIT_COUNT;
+    if (cursor->cell_num == LEAF_NODE_MAX_CELLS && *leaf_node_next_leaf(new_node) == 0) {
+	left_split_count = LEAF_NODE_MAX_CELLS;
+	right_split_count = 1;
+    }
+
+    /* 分割复制 */
+    for (int32_t i = LEAF_NODE_MAX_CELLS; i>=0; i--) {
+        void * destination_node;
+	uint32_t index_within_node;
+	if (i >= left_split_count) {
+	    destination_node = new_node;
+	    index_within_node = i - left_split_count;
+	} else {
+            destination_node = old_node;
+	    index_within_node = i;
+	}
+
+	void* destination = leaf_node_cell(destination_node, index_within_node);
+	if (i == cursor->cell_num) {
+	    serialize_row(value, leaf_node_value(destination_node, index_within_node));
+	    *leaf_node_key(destination_node, index_within_node) = key;
+	} else if (i > cursor->cell_num) {
+	    memcpy(destination, leaf_node_cell(old_node,i - 1), LEAF_NODE_CELL_SIZE);
+	} else {
+	    memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+	}
+    }
+
+    /* 更新两个节点的节点个数 */
+    *(leaf_node_num_cells(old_node)) = left_split_count;
+    *(leaf_node_num_cells(new_node)) = right_split_count;
+
+    table->has_last_leaf = true;
+    table->last_leaf_page_num = cursor->cell_num >= left_split_count ? new_page_num : cursor->page_num;
+
+    if (is_node_root(old_node)) {
+	create_new_root(table, new_page_num);
+	/* 旧的根节点的内容被移动到了新的左孩子中 */
+	if (table->last_leaf_page_num == table->root_page_num) {
+	    table->last_leaf_page_num = *internal_node_child(get_page(table->pager, table->root_page_num), 0);
+	}
+    } else {
+	uint64_t parent_page_num = *node_parent(old_node);
+	uint32_t new_max = get_node_max_key(old_node);
+	void *parent = get_page(table->pager, parent_page_num);
+
+	update_internal_node_key(parent, old_max, new_max);
+	internal_node_insert(table, parent_page_num, new_page_num);
+    }
+}
+
+uint64_t get_unused_page_num(Pager *pager) {
     return pager->num_pages;
 }
 
 
-void create_new_root(Table *table, uint32_t right_child_page_num) {
-    /* root 节点相当于以前的左节点 */
-    void *root = get_page(table->pager, table->root_page_num);
-    void *right_child = get_page(table->pager, right_child_page_num);
-    uint32_t left_child_page_num = get_unused_page_num(table->pager);
-    void *left_child = get_page(table->pager, left_child_page_num);
+void create_new_root(Table *table, uint64_t right_child_page_num) {
+    /* root 节点相当于以前的左节点 */
+    void *root = get_page(table->pager, table->root_page_num);
+    void *right_child = get_page(table->pager, right_child_page_num);
+    uint64_t left_child_page_num = get_unused_page_num(table->pager);
+    void *left_child = get_page(table->pager, left_child_page_num);
+
+    /* 将 root 节点的数据复制给做节点 */
+    memcpy(left_child, root, PAGE_SIZE);
+    set_node_root(left_child, false);
+
+    /* root 节点是一个只有一个键和两个孩子的节点 */
+    initialize_internal_node(root);
+    set_node_root(root, true);
+    *internal_node_num_keys(root) = 1;
+    *internal_node_child(root, 0) = left_child_page_num;
+    uint32_t left_child_max_key = get_node_max_key(left_child);
+    *internal_node_key(root, 0) = left_child_max_key;
+    *internal_node_right_child(root) = right_child_page_num;
+    *node_parent(left_child) = table->root_page_num;
+    *node_parent(right_child) = table->root_page_num;
+}
+
+uint32_t *internal_node_num_keys(void *node) {
+    return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+}
+
+uint64_t *internal_node_right_child(void *node) {
+    return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+}
+
+void *internal_node_cell(void *node, uint32_t cell_num) {
+    return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+}
+
+uint64_t *internal_node_child(void *node, uint32_t child_num) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if (child_num > num_keys) {
+        printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
+	exit(EXIT_FAILURE);
+    }
+    if (child_num == num_keys) {
+        return internal_node_right_child(node);
+    }
+
+    return internal_node_cell(node, child_num);
+}
+
+
+uint32_t *internal_node_key(void *node, uint32_t key_num) {
+    return internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+}
+
+uint32_t get_node_max_key(void *node) {
+    switch (get_node_type(node)) {
+        case NODE_INTERNAL:
+	    return *internal_node_key(node, *internal_node_num_keys(node) - 1);
+	case NODE_LEAF:
+	    return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+    }
+}
+
+bool is_node_root(void *node) {
+    uint8_t value = *((uint8_t*) (node + IS_ROOT_OFFSET));
+    return (bool)value;
+}
+
+void set_node_root(void *node, bool is_root) {
+    uint8_t value = is_root;
+    *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
+}
+
+void initialize_internal_node(void *node) {
+    set_node_type(node, NODE_INTERNAL);
+    set_node_root(node, false);
+    *internal_node_num_keys(node) = 0;
+}
+
+void indent(uint32_t level) {
+    for (uint32_t i = 0; i < level; i++) {
+        printf("  ");
+    }
+}
+
+void print_tree(Pager *pager, uint64_t page_num, uint32_t indentation_level) {
+    void *node = get_page(pager, page_num);
+    uint32_t num_keys;
+    uint64_t child;
+
+    switch (get_node_type(node)) {
+        case (NODE_LEAF):
+	    num_keys = *leaf_node_num_cells(node);
+	    indent(indentation_level);
+	    printf("- leaf (size %d)\n", num_keys);
+	    for (uint32_t i = 0; i < num_keys; i++) {
+	        indent(indentation_level + 1);
+		printf("- %d\n", *leaf_node_key(node, i));
+	    }
+	    break;
+	case (NODE_INTERNAL):
+	    num_keys = *internal_node_num_keys(node);
+	    indent(indentation_level);
+	    printf("- internal (size %d)\n", num_keys);
+	    for (uint32_t i = 0; i < num_keys; i++) {
+	        child = *internal_node_child(node, i);
+		print_tree(pager, child, indentation_level + 1);
+
+		indent(indentation_level);
+		printf("- key %d\n", *internal_node_key(node, i));
+	    }
+
+	    child = *internal_node_right_child(node);
+	    print_tree(pager, child, indentation_level + 1);
+	    break;
+    }
+}
+
+
+void internal_node_find(Table *table, uint64_t page_num, uint32_t key, Cursor *cursor) {
+    void *node = get_page(table->pager, page_num);
+    if (active_trace) {
+	active_trace->nodes_visited += 1;
+    }
+
+    uint32_t child_index = internal_node_find_child(node, key);
+    uint64_t child_num = *internal_node_child(node, child_index);
+    void *child = get_page(table->pager, child_num);
+    switch (get_node_type(child)) {
+        case NODE_LEAF:
+	    leaf_node_find(table, child_num, key, cursor);
+	    break;
+	case NODE_INTERNAL:
+	    internal_node_find(table, child_num, key, cursor);
+	    break;
+    }
+}
+
+uint32_t internal_node_find_child(void *node, uint32_t key) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+
+    /* Binary search to find index of child to search */
+    uint32_t min_index = 0;
+    uint32_t max_index = num_keys;
+
+    while (min_index != max_index) {
+        uint32_t index = (min_index + max_index) / 2;
+        uint32_t key_to_right = *internal_node_key(node, index);
+        if (key_to_right >= key) {
+            max_index = index;
+        } else {
+            min_index = index + 1;
+        }
+    }
+
+    return min_index;
+}
+
+/* 孩子的最大键发生变化后，更新父节点中对应的键。最右孩子的最大键不在父节点中。 */
+void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key) {
+    uint32_t old_child_index = internal_node_find_child(node, old_key);
+    if (old_child_index < *internal_node_num_keys(node)) {
+	*internal_node_key(node, old_child_index) = new_key;
+    }
+}
+
+/* 将分裂出来的新节点插入到父节点中 */
+void internal_node_insert(Table *table, uint64_t parent_page_num, uint64_t child_page_num) {
+    void *parent = get_page(table->pager, parent_page_num);
+    void *child = get_page(table->pager, child_page_num);
+    uint32_t child_max_key = get_node_max_key(child);
+    uint32_t index = internal_node_find_child(parent, child_max_key);
+
+    uint32_t original_num_keys = *internal_node_num_keys(parent);
+    if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
+	printf("Need to implement splitting internal node\n");
+	exit(EXIT_FAILURE);
+    }
+    *internal_node_num_keys(parent) = original_num_keys + 1;
+
+    uint64_t right_child_page_num = *internal_node_right_child(parent);
+    void *right_child = get_page(table->pager, right_child_page_num);
+
+    if (child_max_key > get_node_max_key(right_child)) {
+	/* 新节点成为最右孩子，原来的最右孩子放到最后一个 cell 中 */
+	*internal_node_child(parent, original_num_keys) = right_child_page_num;
+	*internal_node_key(parent, original_num_keys) = get_node_max_key(right_child);
+	*internal_node_right_child(parent) = child_page_num;
+    } else {
+	for (uint32_t i = original_num_keys; i > index; i--) {
+	    memcpy(internal_node_cell(parent, i), internal_node_cell(parent, i - 1), INTERNAL_NODE_CELL_SIZE);
+	}
+	*internal_node_child(parent, index) = child_page_num;
+	*internal_node_key(parent, index) = child_max_key;
+    }
+}
+
+uint64_t* leaf_node_next_leaf(void *node) {
+    return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+}
+
+uint64_t *node_parent(void *node) {
+    return node + PARENT_POINTER_OFFSET;
+}
+
+uint32_t *header_version(void *page) {
+    return page + HEADER_VERSION_OFFSET;
+}
+
+uint32_t *header_page_size(void *page) {
+    return page + HEADER_PAGE_SIZE_OFFSET;
+}
+
+uint64_t *header_root_page_num(void *page) {
+    return page + HEADER_ROOT_PAGE_NUM_OFFSET;
+}
+
+void initialize_header(void *page, uint64_t root_page_num) {
+    memset(page, 0, PAGE_SIZE);
+    memcpy(page + HEADER_MAGIC_OFFSET, DB_FILE_MAGIC, HEADER_MAGIC_SIZE);
+    *header_version(page) = DB_FORMAT_VERSION;
+    *header_page_size(page) = PAGE_SIZE;
+    *header_root_page_num(page) = root_page_num;
+}
+
+/* 将整棵树按键的顺序重建到新文件中：根节点在 0 号页面，叶子依次存放在其后，
+ * 每个叶子按 fill_factor 填充。新文件写完后通过 rename 原子地替换旧文件。 */
+void db_vacuum(Table *table, uint32_t fill_factor) {
+    uint32_t cells_per_leaf = LEAF_NODE_MAX_CELLS * fill_factor / 100;
+    if (cells_per_leaf == 0) {
+	cells_per_leaf = 1;
+    }
+
+    /* 写时复制模式下从最新的版本重建，重建完成之前其他进程不能提交 */
+    db_begin_write(table);
+
+    /* 先沿着叶子链表统计记录数，只需要读取叶子的头部 */
+    Cursor *cursor = table_start(table);
+    uint64_t num_rows = 0;
+    uint64_t page_num = cursor->page_num;
+    while (!(cursor->end_of_table)) {
+	void *node = get_page(table->pager, page_num);
+	num_rows += *leaf_node_num_cells(node);
+	page_num = *leaf_node_next_leaf(node);
+	if (page_num == 0) {
+	    break;
+	}
+    }
+
+    char *vacuum_filename = temp_filename(table->filename, ".vacuum");
+    TreeBuilder builder;
+    if (!tree_builder_open(&builder, vacuum_filename, num_rows, cells_per_leaf, table->pager->cow)) {
+	printf("Table too large to vacuum with fill factor %d.\n", fill_factor);
+	free(vacuum_filename);
+	free(cursor);
+	return;
+    }
+
+    /* 按顺序把 cell 原样复制到新的叶子中 */
+    while (!(cursor->end_of_table)) {
+	void *old_node = get_page(table->pager, cursor->page_num);
+	tree_builder_append(&builder, leaf_node_cell(old_node, cursor->cell_num));
+	cursor_advance(cursor);
+    }
+    free(cursor);
+
+    uint64_t num_leaves = builder.num_leaves;
+    uint64_t old_num_pages = table->pager->num_pages;
+    uint64_t new_num_pages = tree_builder_finish(&builder);
+
+    if (rename(vacuum_filename, table->filename) == -1) {
+	printf("Error replacing db file: %d\n", errno);
+	exit(EXIT_FAILURE);
+    }
+    cow_remove_lock_file(vacuum_filename);
+    free(vacuum_filename);
+
+    /* 旧文件已经被替换，缓存中的页面不能再写回 */
+    pager_free(table->pager);
+    table->pager = pager_open(table->filename, false);
+    table->root_page_num = *header_root_page_num(get_page(table->pager, 0));
+    table->has_last_leaf = false;
+    if (table->hash_index) {
+	hash_index_reset(table->hash_index);
+    }
+
+    printf("Vacuumed %" PRIu64 " rows into %" PRIu64 " leaves, pages %" PRIu64 " -> %" PRIu64 ".\n",
+	   num_rows, num_leaves, old_num_pages, new_num_pages);
+}
+
+/* 旧格式的 0 号页面是根节点：节点类型有效、是根节点，下降到第一个叶子和叶子链表经过的页号都在文件内 */
+bool legacy_file_valid(Pager *pager) {
+    void *node = get_page(pager, 0);
+    uint8_t type = *(uint8_t *)(node + NODE_TYPE_OFFSET);
+    if ((type != NODE_INTERNAL && type != NODE_LEAF) || !is_node_root(node)) {
+	return false;
+    }
+
+    uint64_t page_num = 0;
+    uint64_t steps = 0;
+    while (get_node_type(node) == NODE_INTERNAL) {
+	uint32_t num_keys = *(uint32_t *)(node + LEGACY_NODE_NUM_CELLS_OFFSET);
+	page_num = num_keys > 0 ? *(uint32_t *)(node + LEGACY_INTERNAL_NODE_HEADER_SIZE)
+	                        : *(uint32_t *)(node + LEGACY_INTERNAL_NODE_RIGHT_CHILD_OFFSET);
+	steps += 1;
+	if (page_num == 0 || page_num >= pager->num_pages || page_num >= TABLE_MAX_PAGES || steps > pager->num_pages) {
+	    return false;
+	}
+	node = get_page(pager, page_num);
+	type = *(uint8_t *)(node + NODE_TYPE_OFFSET);
+	if (type != NODE_INTERNAL && type != NODE_LEAF) {
+	    return false;
+	}
+    }
+
+    /* 页号不超过文件的页数，链表的长度也不会超过页数，否则有环 */
+    steps = 0;
+    do {
+	node = get_page(pager, page_num);
+	if (get_node_type(node) != NODE_LEAF
+	    || *(uint32_t *)(node + LEGACY_NODE_NUM_CELLS_OFFSET) > (PAGE_SIZE - LEGACY_LEAF_NODE_HEADER_SIZE) / LEAF_NODE_CELL_SIZE) {
+	    return false;
+	}
+	page_num = *(uint32_t *)(node + LEGACY_LEAF_NODE_NEXT_LEAF_OFFSET);
+	steps += 1;
+	if (page_num >= pager->num_pages || page_num >= TABLE_MAX_PAGES || steps > pager->num_pages) {
+	    return false;
+	}
+    } while (page_num != 0);
+    return true;
+}
+
+void db_migrate(const char *filename) {
+    Pager *old_pager = pager_open(filename, false);
+
+    /* 从旧的根节点一直向左下降，找到第一个叶子 */
+    uint64_t first_page_num = 0;
+    void *node = get_page(old_pager, first_page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+	uint32_t num_keys = *(uint32_t *)(node + LEGACY_NODE_NUM_CELLS_OFFSET);
+	if (num_keys > 0) {
+	    first_page_num = *(uint32_t *)(node + LEGACY_INTERNAL_NODE_HEADER_SIZE);
+	} else {
+	    first_page_num = *(uint32_t *)(node + LEGACY_INTERNAL_NODE_RIGHT_CHILD_OFFSET);
+	}
+	node = get_page(old_pager, first_page_num);
+    }
+
+    uint64_t num_rows = 0;
+    uint64_t page_num = first_page_num;
+    do {
+	node = get_page(old_pager, page_num);
+	num_rows += *(uint32_t *)(node + LEGACY_NODE_NUM_CELLS_OFFSET);
+	page_num = *(uint32_t *)(node + LEGACY_LEAF_NODE_NEXT_LEAF_OFFSET);
+    } while (page_num != 0);
+
+    char *migrate_filename = temp_filename(filename, ".migrate");
+    TreeBuilder builder;
+    if (!tree_builder_open(&builder, migrate_filename, num_rows, LEAF_NODE_MAX_CELLS, pager_config.cow)) {
+	printf("Db file is too large to migrate.\n");
+	exit(EXIT_FAILURE);
+    }
+
+    /* cell 的布局没有变化，可以原样复制 */
+    page_num = first_page_num;
+    do {
+	node = get_page(old_pager, page_num);
+	uint32_t num_cells = *(uint32_t *)(node + LEGACY_NODE_NUM_CELLS_OFFSET);
+	for (uint32_t i = 0; i < num_cells; i++) {
+	    tree_builder_append(&builder, node + LEGACY_LEAF_NODE_HEADER_SIZE + i * LEAF_NODE_CELL_SIZE);
+	}
+	page_num = *(uint32_t *)(node + LEGACY_LEAF_NODE_NEXT_LEAF_OFFSET);
+    } while (page_num != 0);
+
+    tree_builder_finish(&builder);
+    pager_free(old_pager);
+
+    if (rename(migrate_filename, filename) == -1) {
+	printf("Error replacing db file: %d\n", errno);
+	exit(EXIT_FAILURE);
+    }
+    cow_remove_lock_file(migrate_filename);
+    free(migrate_filename);
+
+    printf("Migrated %" PRIu64 " rows to db format version %d.\n", num_rows, DB_FORMAT_VERSION);
+}
+
+char *temp_filename(const char *filename, const char *suffix) {
+    size_t filename_length = strlen(filename);
+    char *result = malloc(filename_length + strlen(suffix) + 1);
+    memcpy(result, filename, filename_length);
+    strcpy(result + filename_length, suffix);
+    return result;
+}
+
+/* 新文件的根节点在 1 号页面，只有一个叶子时根节点就是这个叶子，
+ * 否则叶子依次存放在 2 号页面之后。空间不够时返回 false。 */
+bool tree_builder_open(TreeBuilder *builder, const char *filename, uint64_t num_rows, uint32_t cells_per_leaf, bool cow) {
+    uint64_t num_leaves = (num_rows + cells_per_leaf - 1) / cells_per_leaf;
+    if (num_leaves == 0) {
+	num_leaves = 1;
+    }
+    uint64_t first_leaf = num_leaves == 1 ? 1 : 2;
+    if (first_leaf + num_leaves > TABLE_MAX_PAGES || num_leaves - 1 > INTERNAL_NODE_MAX_CELLS) {
+	return false;
+    }
+
+    unlink(filename);
+    builder->pager = pager_open(filename, cow);
+    builder->cells_per_leaf = cells_per_leaf;
+    builder->num_leaves = num_leaves;
+    builder->first_leaf = first_leaf;
+    builder->leaf = 0;
+
+    for (uint64_t leaf = 0; leaf < num_leaves; leaf++) {
+	void *node = get_page(builder->pager, first_leaf + leaf);
+	initialize_leaf_node(node);
+	*node_parent(node) = 1;
+	*leaf_node_next_leaf(node) = leaf + 1 < num_leaves ? first_leaf + leaf + 1 : 0;
+    }
+
+    return true;
+}
+
+void tree_builder_append(TreeBuilder *builder, void *cell) {
+    void *node = get_page(builder->pager, builder->first_leaf + builder->leaf);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (num_cells == builder->cells_per_leaf) {
+	builder->leaf += 1;
+	node = get_page(builder->pager, builder->first_leaf + builder->leaf);
+	num_cells = 0;
+    }
+
+    memcpy(leaf_node_cell(node, num_cells), cell, LEAF_NODE_CELL_SIZE);
+    *leaf_node_num_cells(node) = num_cells + 1;
+}
+
+/* 写入根节点和文件头，将所有页面写回磁盘，返回新文件的页面数 */
+uint64_t tree_builder_finish(TreeBuilder *builder) {
+    Pager *pager = builder->pager;
+    initialize_header(get_page(pager, 0), 1);
+
+    void *root = get_page(pager, 1);
+    if (builder->num_leaves > 1) {
+	initialize_internal_node(root);
+	*internal_node_num_keys(root) = builder->num_leaves - 1;
+	for (uint64_t leaf = 0; leaf + 1 < builder->num_leaves; leaf++) {
+	    *internal_node_child(root, leaf) = builder->first_leaf + leaf;
+	    *internal_node_key(root, leaf) = get_node_max_key(get_page(pager, builder->first_leaf + leaf));
+	}
+	*internal_node_right_child(root) = builder->first_leaf + builder->num_leaves - 1;
+    }
+    set_node_root(root, true);
+    *node_parent(root) = 0;
+
+    uint64_t num_pages = pager->num_pages;
+    pager_flush_all(pager);
+    if (fsync(pager->file_descriptor) == -1) {
+	printf("Error syncing db file: %d\n", errno);
+	exit(EXIT_FAILURE);
+    }
+    pager_free(pager);
+
+    return num_pages;
+}
+
+/* 文件的前 8 个字节是否是 magic，用来识别分区表的目录文件和 LSM 的清单文件 */
+bool file_has_magic(const char *filename, const char *magic) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    char header[8];
+    ssize_t bytes_read = pread(fd, header, sizeof(header), 0);
+    close(fd);
+    return bytes_read == sizeof(header) && memcmp(header, magic, sizeof(header)) == 0;
+}
+
+Table *catalog_open(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    uint8_t header[CATALOG_HEADER_SIZE];
+    if (fd == -1 || pread(fd, header, CATALOG_HEADER_SIZE, 0) != CATALOG_HEADER_SIZE) {
+        printf("Unable to read partition catalog\n");
+	exit(EXIT_FAILURE);
+    }
+
+    uint32_t version, num_partitions;
+    memcpy(&version, header + 8, sizeof(uint32_t));
+    memcpy(&num_partitions, header + 12, sizeof(uint32_t));
+    if (version != CATALOG_FORMAT_VERSION || num_partitions == 0 || num_partitions > MAX_PARTITIONS) {
+        printf("Unsupported partition catalog.\n");
+	exit(EXIT_FAILURE);
+    }
+
+    Table *table = malloc(sizeof(Table));
+    table->pager = NULL;
+    table->root_page_num = 0;
+    table->filename = strdup(filename);
+    table->has_last_leaf = false;
+    table->hash_index = NULL;
+    table->num_partitions = num_partitions;
+    table->lsm = NULL;
+
+    ssize_t bounds_size = num_partitions * sizeof(uint32_t);
+    if (pread(fd, table->partition_lower_bounds, bounds_size, CATALOG_HEADER_SIZE) != bounds_size) {
+        printf("Unable to read partition catalog\n");
+	exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    for (uint32_t i = 0; i < num_partitions; i++) {
+        char *name = partition_filename(filename, i);
+	table->partitions[i] = db_open(name);
+	free(name);
+    }
+
+    return table;
+}
+
+/* 先写临时文件再 rename，目录文件的替换是原子的 */
+void catalog_write(Table *table, const char *filename) {
+    char *catalog_filename = temp_filename(filename, ".catalog");
+    int fd = open(catalog_filename, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (fd == -1) {
+        printf("Unable to open file\n");
+	exit(EXIT_FAILURE);
+    }
+
+    uint8_t header[CATALOG_HEADER_SIZE];
+    uint32_t version = CATALOG_FORMAT_VERSION;
+    memcpy(header, CATALOG_FILE_MAGIC, 8);
+    memcpy(header + 8, &version, sizeof(uint32_t));
+    memcpy(header + 12, &(table->num_partitions), sizeof(uint32_t));
+
+    ssize_t bounds_size = table->num_partitions * sizeof(uint32_t);
+    if (pwrite(fd, header, CATALOG_HEADER_SIZE, 0) != CATALOG_HEADER_SIZE
+        || pwrite(fd, table->partition_lower_bounds, bounds_size, CATALOG_HEADER_SIZE) != bounds_size
+	|| fsync(fd) == -1) {
+	printf("Error writing: %d\n", errno);
+	exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    if (rename(catalog_filename, filename) == -1) {
+        printf("Error replacing db file: %d\n", errno);
+	exit(EXIT_FAILURE);
+    }
+    free(catalog_filename);
+}
+
+char *partition_filename(const char *filename, uint32_t partition) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".p%d", partition);
+    return temp_filename(filename, suffix);
+}
+
+/* 将普通的表转换为分区表。每个分区的数据用 TreeBuilder 写入自己的文件，
+ * 最后用目录文件原子地替换原来的数据库文件。 */
+void db_partition(Table *table, uint32_t *lower_bounds, uint32_t num_partitions) {
+    /* 先统计每个分区的记录数 */
+    uint64_t num_rows[MAX_PARTITIONS];
+    memset(num_rows, 0, sizeof(num_rows));
+    uint32_t partition = 0;
+    Cursor *cursor = table_start(table);
+    while (!(cursor->end_of_table)) {
+        uint32_t key = *leaf_node_key(get_page(table->pager, cursor->page_num), cursor->cell_num);
+	while (partition + 1 < num_partitions && key >= lower_bounds[partition + 1]) {
+	    partition += 1;
+	}
+	num_rows[partition] += 1;
+	cursor_advance(cursor);
+    }
+    free(cursor);
+
+    TreeBuilder builders[MAX_PARTITIONS];
+    for (uint32_t i = 0; i < num_partitions; i++) {
+        char *name = partition_filename(table->filename, i);
+	bool opened = tree_builder_open(&(builders[i]), name, num_rows[i], LEAF_NODE_MAX_CELLS, table->pager->cow);
+	free(name);
+	if (!opened) {
+	    printf("Partition %d is too large.\n", i);
+	    /* 删除已经创建的分区文件 */
+	    for (uint32_t j = 0; j < i; j++) {
+	        pager_free(builders[j].pager);
+		char *created = partition_filename(table->filename, j);
+		unlink(created);
+		cow_remove_lock_file(created);
+		free(created);
+	    }
+	    return;
+	}
+    }
+
+    partition = 0;
+    cursor = table_start(table);
+    while (!(cursor->end_of_table)) {
+        void *node = get_page(table->pager, cursor->page_num);
+	uint32_t key = *leaf_node_key(node, cursor->cell_num);
+	while (partition + 1 < num_partitions && key >= lower_bounds[partition + 1]) {
+	    partition += 1;
+	}
+	tree_builder_append(&(builders[partition]), leaf_node_cell(node, cursor->cell_num));
+	cursor_advance(cursor);
+    }
+    free(cursor);
+
+    for (uint32_t i = 0; i < num_partitions; i++) {
+        tree_builder_finish(&(builders[i]));
+    }
+
+    /* 旧文件会被目录文件替换，缓存中的页面不能再写回 */
+    table->num_partitions = num_partitions;
+    memcpy(table->partition_lower_bounds, lower_bounds, num_partitions * sizeof(uint32_t));
+    catalog_write(table, table->filename);
+    pager_free(table->pager);
+    table->pager = NULL;
+    hash_index_free(table->hash_index);
+    table->hash_index = NULL;
+    table->has_last_leaf = false;
+
+    for (uint32_t i = 0; i < num_partitions; i++) {
+        char *name = partition_filename(table->filename, i);
+	table->partitions[i] = db_open(name);
+	free(name);
+    }
+
+    printf("Partitioned table into %d partitions.\n", num_partitions);
+}
+
+/* 返回 key 所在的分区 */
+uint32_t table_partition_index(Table *table, uint32_t key) {
+    uint32_t min_index = 0;
+    uint32_t max_index = table->num_partitions - 1;
+    while (min_index < max_index) {
+        uint32_t index = (min_index + max_index + 1) / 2;
+	if (table->partition_lower_bounds[index] <= key) {
+	    min_index = index;
+	} else {
+	    max_index = index - 1;
+	}
+    }
+    return min_index;
+}
+
+/* 根据 id 的条件判断分区中是否可能有满足条件的记录 */
+bool partition_may_match(Table *table, uint32_t partition, Predicate *predicate) {
+    if (!predicate->enabled || predicate->column != COLUMN_ID) {
+        return true;
+    }
+
+    uint32_t lower = table->partition_lower_bounds[partition];
+    bool has_upper = partition + 1 < table->num_partitions;
+    uint32_t upper = has_upper ? table->partition_lower_bounds[partition + 1] : 0;
+    switch (predicate->op) {
+        case (COMPARE_EQUAL):
+	    return table_partition_index(table, predicate->id) == partition;
+	case (COMPARE_LESS):
+	    return lower < predicate->id;
+	case (COMPARE_LESS_EQUAL):
+	    return lower <= predicate->id;
+	case (COMPARE_GREATER):
+	    return !has_upper || upper - 1 > predicate->id;
+	case (COMPARE_GREATER_EQUAL):
+	    return !has_upper || upper - 1 >= predicate->id;
+	default:
+	    return true;
+    }
+}
+
+void *partition_scan_thread(void *argument) {
+    PartitionScan *scan = argument;
+    cookie_io_functions_t functions = {NULL, partition_output_write, NULL, NULL};
+    FILE *out = fopencookie(scan, "w", functions);
+    RowSink sink;
+    row_sink_init(&sink, scan->statement, out);
+    table_scan(scan->statement, scan->table, &sink);
+    fclose(out);
+
+    pthread_mutex_lock(&(scan->mutex));
+    scan->finished = true;
+    pthread_cond_signal(&(scan->changed));
+    pthread_mutex_unlock(&(scan->mutex));
+    return NULL;
+}
+
+/* 扫描线程的输出写入缓冲区，缓冲区满了时等待主线程取走 */
+ssize_t partition_output_write(void *cookie, const char *data, size_t size) {
+    PartitionScan *scan = cookie;
+    size_t written = 0;
+    pthread_mutex_lock(&(scan->mutex));
+    while (written < size) {
+	while (scan->length == PARTITION_OUTPUT_BUFFER_SIZE) {
+	    pthread_cond_wait(&(scan->changed), &(scan->mutex));
+	}
+	size_t count = size - written;
+	if (count > PARTITION_OUTPUT_BUFFER_SIZE - scan->length) {
+	    count = PARTITION_OUTPUT_BUFFER_SIZE - scan->length;
+	}
+	memcpy(scan->buffer + scan->length, data + written, count);
+	scan->length += count;
+	written += count;
+	pthread_cond_signal(&(scan->changed));
+    }
+    pthread_mutex_unlock(&(scan->mutex));
+    return size;
+}
+
+/* 主线程把一个分区的输出原样写到 out，直到这个分区扫描结束 */
+void partition_scan_drain(PartitionScan *scan, FILE *out) {
+    pthread_mutex_lock(&(scan->mutex));
+    while (true) {
+	while (scan->length == 0 && !(scan->finished)) {
+	    pthread_cond_wait(&(scan->changed), &(scan->mutex));
+	}
+	if (scan->length == 0) {
+	    break;
+	}
+	fwrite(scan->buffer, 1, scan->length, out);
+	scan->length = 0;
+	pthread_cond_signal(&(scan->changed));
+    }
+    pthread_mutex_unlock(&(scan->mutex));
+}
+
+/* --batch <file|-> 从文件或标准输入读取语句，不输出提示符和 Executed.，
+ * 只输出错误、查询的结果和最后的吞吐量统计 */
+void run_batch(Table *table, const char *source) {
+    BatchQueue *queue = malloc(sizeof(BatchQueue));
+    queue->head = 0;
+    queue->count = 0;
+    queue->stopped = false;
+    queue->data = NULL;
+    queue->size = 0;
+    queue->offset = 0;
+    queue->stream_fd = -1;
+    queue->buffer = NULL;
+    queue->buffer_size = 0;
+    queue->buffer_start = 0;
+    queue->buffer_end = 0;
+    queue->eof = false;
+    queue->bytes_read = 0;
+    if (pipe(queue->wake_pipe) == -1) {
+        printf("Unable to create pipe: %d\n", errno);
+	exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&(queue->mutex), NULL);
+    pthread_cond_init(&(queue->not_empty), NULL);
+    pthread_cond_init(&(queue->not_full), NULL);
+
+    struct stat st;
+    int fd = strcmp(source, "-") == 0 ? -1 : open(source, O_RDONLY);
+    if (fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        queue->size = st.st_size;
+	if (queue->size > 0) {
+	    queue->data = mmap(NULL, queue->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	    if (queue->data == MAP_FAILED) {
+	        printf("Unable to map batch file: %d\n", errno);
+		exit(EXIT_FAILURE);
+	    }
+	    madvise(queue->data, queue->size, MADV_SEQUENTIAL);
+	}
+    } else {
+	if (fd == -1 && strcmp(source, "-") != 0) {
+	    printf("Unable to open batch input '%s'\n", source);
+	    exit(EXIT_FAILURE);
+	}
+	queue->stream_fd = fd == -1 ? STDIN_FILENO : fd;
+	queue->buffer_size = BATCH_STDIN_BUFFER_SIZE;
+	queue->buffer = malloc(queue->buffer_size);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (pthread_create(&(queue->parser), NULL, batch_parser_thread, queue) != 0) {
+        printf("Unable to start batch parser.\n");
+	exit(EXIT_FAILURE);
+    }
+
+    uint64_t num_statements = 0;
+    uint64_t num_errors = 0;
+    bool done = false;
+    while (!done) {
+        BatchChunk *chunk = batch_next_chunk(queue);
+	for (uint32_t i = 0; i < chunk->num_items && !done; i++) {
+	    BatchItem *item = &(chunk->items[i]);
+	    InputBuffer input_buffer = { item->line, 0, item->line ? strlen(item->line) : 0 };
+
+	    if (item->meta_command) {
+	        if (strcmp(item->line, ".exit") == 0) {
+		    done = true;
+		} else if (do_meta_command(&input_buffer, table) == META_COMMAND_UNRECOGNIZED_COMMAND) {
+		    printf("Unrecognized command '%s'\n", item->line);
+		    num_errors += 1;
+		}
+	    } else {
+	        num_statements += 1;
+		if (item->result != PREPARE_SUCCESS) {
+		    print_prepare_error(item->result, &input_buffer);
+		    num_errors += 1;
+		} else {
+		    ExecuteResult result = execute_statement(&(item->statement), table);
+		    if (result != EXECUTE_SUCCESS) {
+		        print_execute_error(result);
+			num_errors += 1;
+		    }
+		}
+	    }
+	}
+	done = done || chunk->last;
+	batch_release_chunk(queue);
+	/* 写时复制模式下每一组语句提交一次 */
+	db_commit(table);
+    }
+
+    /* .exit 之后通知解析线程停止，丢弃已经解析好的语句。
+     * 解析线程可能在等待输入，写入 wake_pipe 唤醒它，不需要等到输入结束 */
+    pthread_mutex_lock(&(queue->mutex));
+    queue->stopped = true;
+    pthread_cond_broadcast(&(queue->not_full));
+    pthread_mutex_unlock(&(queue->mutex));
+    if (write(queue->wake_pipe[1], "", 1) == -1) {
+        printf("Error writing: %d\n", errno);
+	exit(EXIT_FAILURE);
+    }
+    pthread_join(queue->parser, NULL);
+    while (queue->count > 0) {
+        batch_release_chunk(queue);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ms = elapsed_ms(&start, &end);
+    double seconds = ms > 0 ? ms / 1000 : 1e-9;
+    printf("Batch: %" PRIu64 " statements, %" PRIu64 " errors in %.3f ms (%.0f statements/s, %.2f MB/s)\n",
+	   num_statements, num_errors, ms, num_statements / seconds,
+	   queue->bytes_read / seconds / (1024 * 1024));
+
+    if (queue->data != NULL) {
+        munmap(queue->data, queue->size);
+    }
+    free(queue->buffer);
+    if (fd != -1) {
+        close(fd);
+    }
+    close(queue->wake_pipe[0]);
+    close(queue->wake_pipe[1]);
+    pthread_mutex_destroy(&(queue->mutex));
+    pthread_cond_destroy(&(queue->not_empty));
+    pthread_cond_destroy(&(queue->not_full));
+    free(queue);
+}
+
+/* 读取下一行（不含换行符）到 input_buffer 中，输入结束或主线程已经停止时返回 false */
+bool batch_read_line(BatchQueue *queue, InputBuffer *input_buffer) {
+    char *line;
+    size_t length;
+    if (queue->buffer != NULL) {
+	/* 缓冲区中没有完整的一行时才读取 */
+	while (!batch_line_ready(queue)) {
+	    if (!batch_fill_buffer(queue)) {
+		return false;
+	    }
+	}
+	if (queue->buffer_start == queue->buffer_end) {
+	    return false;
+	}
+	line = queue->buffer + queue->buffer_start;
+	char *newline = memchr(line, '\n', queue->buffer_end - queue->buffer_start);
+	length = newline ? (size_t)(newline - line) : queue->buffer_end - queue->buffer_start;
+	queue->buffer_start += newline ? length + 1 : length;
+    } else {
+	if (queue->offset >= queue->size) {
+	    return false;
+	}
+	line = queue->data + queue->offset;
+	char *newline = memchr(line, '\n', queue->size - queue->offset);
+	length = newline ? (size_t)(newline - line) : queue->size - queue->offset;
+	queue->offset += newline ? length + 1 : length;
+	queue->bytes_read = queue->offset;
+    }
+
+    /* 解析会修改输入，复制到 input_buffer 中 */
+    if (input_buffer->buffer_length < length + 1) {
+        input_buffer->buffer_length = length + 1;
+	input_buffer->buffer = realloc(input_buffer->buffer, input_buffer->buffer_length);
+    }
+    memcpy(input_buffer->buffer, line, length);
+    input_buffer->buffer[length] = 0;
+    input_buffer->input_length = length;
+    return true;
+}
+
+/* 不需要等待输入就能得到下一行（或者知道输入已经结束） */
+bool batch_line_ready(BatchQueue *queue) {
+    if (queue->buffer == NULL || queue->eof) {
+	return true;
+    }
+    return memchr(queue->buffer + queue->buffer_start, '\n', queue->buffer_end - queue->buffer_start) != NULL;
+}
+
+/* 读取下一行可能阻塞时，主线程正在等待或者暂时没有输入，就先交出已经解析好的语句 */
+bool batch_should_publish(BatchQueue *queue) {
+    if (batch_line_ready(queue)) {
+	return false;
+    }
+
+    pthread_mutex_lock(&(queue->mutex));
+    bool empty = queue->count == 0;
+    pthread_mutex_unlock(&(queue->mutex));
+    if (empty) {
+	return true;
+    }
+    struct pollfd input = { queue->stream_fd, POLLIN, 0 };
+    return poll(&input, 1, 0) == 0;
+}
+
+/* 读入更多的输入，同时等待 wake_pipe，主线程停止时返回 false */
+bool batch_fill_buffer(BatchQueue *queue) {
+    /* 把未处理的部分移到开头，一行比缓冲区还长时扩大缓冲区 */
+    size_t remaining = queue->buffer_end - queue->buffer_start;
+    memmove(queue->buffer, queue->buffer + queue->buffer_start, remaining);
+    queue->buffer_start = 0;
+    queue->buffer_end = remaining;
+    if (remaining == queue->buffer_size) {
+	queue->buffer_size *= 2;
+	queue->buffer = realloc(queue->buffer, queue->buffer_size);
+    }
+
+    struct pollfd fds[2] = { { queue->stream_fd, POLLIN, 0 }, { queue->wake_pipe[0], POLLIN, 0 } };
+    while (poll(fds, 2, -1) == -1) {
+	if (errno != EINTR) {
+	    printf("Error reading batch input: %d\n", errno);
+	    exit(EXIT_FAILURE);
+	}
+    }
+    if (fds[1].revents != 0) {
+	return false;
+    }
+
+    ssize_t bytes_read = read(queue->stream_fd, queue->buffer + queue->buffer_end, queue->buffer_size - queue->buffer_end);
+    if (bytes_read == -1 && errno != EINTR && errno != EAGAIN) {
+	printf("Error reading batch input: %d\n", errno);
+	exit(EXIT_FAILURE);
+    }
+    if (bytes_read == 0) {
+	queue->eof = true;
+    }
+    if (bytes_read > 0) {
+	queue->buffer_end += bytes_read;
+	queue->bytes_read += bytes_read;
+    }
+    return true;
+}
+
+/* 解析线程：一次填满一组语句再交给主线程。输入来自管道时，下一行还没有到达就先交出这一组，
+ * 不等到凑满 BATCH_CHUNK_SIZE 条 */
+void *batch_parser_thread(void *argument) {
+    BatchQueue *queue = argument;
+    InputBuffer *input_buffer = new_input_buffer();
+    bool last = false;
+
+    while (!last) {
+        pthread_mutex_lock(&(queue->mutex));
+	while (queue->count == BATCH_QUEUE_CHUNKS && !(queue->stopped)) {
+	    pthread_cond_wait(&(queue->not_full), &(queue->mutex));
+	}
+	if (queue->stopped) {
+	    pthread_mutex_unlock(&(queue->mutex));
+	    break;
+	}
+	/* 尾部的这一组只有解析线程访问，填写时不需要持有锁 */
+	BatchChunk *chunk = &(queue->chunks[(queue->head + queue->count) % BATCH_QUEUE_CHUNKS]);
+	pthread_mutex_unlock(&(queue->mutex));
+
+	chunk->num_items = 0;
+	while (chunk->num_items < BATCH_CHUNK_SIZE) {
+	    if (chunk->num_items > 0 && batch_should_publish(queue)) {
+		break;
+	    }
+	    if (!batch_read_line(queue, input_buffer)) {
+	        last = true;
+		break;
+	    }
+	    if (input_buffer->input_length == 0) {
+	        continue;
+	    }
+
+	    BatchItem *item = &(chunk->items[chunk->num_items]);
+	    item->meta_command = input_buffer->buffer[0] == '.';
+	    item->line = NULL;
+	    if (item->meta_command) {
+	        item->line = strdup(input_buffer->buffer);
+	    } else {
+	        item->result = prepare_statement(input_buffer, &(item->statement));
+		if (item->result == PREPARE_UNRECOGNIZED_STATEMENT) {
+		    item->line = strdup(input_buffer->buffer);
+		}
+	    }
+	    chunk->num_items += 1;
+	}
+	chunk->last = last;
+
+	pthread_mutex_lock(&(queue->mutex));
+	queue->count += 1;
+	pthread_cond_signal(&(queue->not_empty));
+	pthread_mutex_unlock(&(queue->mutex));
+    }
+
+    free(input_buffer->buffer);
+    free(input_buffer);
+    return NULL;
+}
+
+/* 主线程取出最早的一组语句，必要时等待解析线程 */
+BatchChunk *batch_next_chunk(BatchQueue *queue) {
+    pthread_mutex_lock(&(queue->mutex));
+    while (queue->count == 0) {
+        pthread_cond_wait(&(queue->not_empty), &(queue->mutex));
+    }
+    BatchChunk *chunk = &(queue->chunks[queue->head]);
+    pthread_mutex_unlock(&(queue->mutex));
+    return chunk;
+}
+
+void batch_release_chunk(BatchQueue *queue) {
+    BatchChunk *chunk = &(queue->chunks[queue->head]);
+    for (uint32_t i = 0; i < chunk->num_items; i++) {
+        free(chunk->items[i].line);
+    }
+
+    pthread_mutex_lock(&(queue->mutex));
+    queue->head = (queue->head + 1) % BATCH_QUEUE_CHUNKS;
+    queue->count -= 1;
+    pthread_cond_signal(&(queue->not_full));
+    pthread_mutex_unlock(&(queue->mutex));
+}
+
+/* 打开 LSM 表，文件不存在时新建一个空的清单，并启动后台合并线程 */
+Table *lsm_table_open(const char *filename) {
+    LsmTree *lsm = malloc(sizeof(LsmTree));
+    lsm->filename = strdup(filename);
+    lsm->memtable = malloc((size_t)LSM_MEMTABLE_ROWS * ROW_SIZE);
+    lsm->memtable_rows = 0;
+    lsm->memtable_sorted = true;
+    lsm->memtable_keys = calloc(2 * LSM_MEMTABLE_ROWS, sizeof(uint32_t));
+    lsm->num_runs = 0;
+    lsm->next_run_id = 1;
+    lsm->compactions = 0;
+    lsm->stopping = false;
+    pthread_mutex_init(&(lsm->mutex), NULL);
+    pthread_cond_init(&(lsm->changed), NULL);
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+	lsm_write_manifest(lsm);
+    } else {
+	uint8_t header[LSM_MANIFEST_HEADER_SIZE];
+	uint32_t version, num_runs;
+	if (pread(fd, header, LSM_MANIFEST_HEADER_SIZE, 0) != LSM_MANIFEST_HEADER_SIZE) {
+	    printf("Unable to read LSM manifest\n");
+	    exit(EXIT_FAILURE);
+	}
+	memcpy(&version, header + 8, sizeof(uint32_t));
+	memcpy(&num_runs, header + 12, sizeof(uint32_t));
+	memcpy(&(lsm->next_run_id), header + 16, sizeof(uint64_t));
+	if (version != LSM_FORMAT_VERSION || num_runs > LSM_MAX_RUNS) {
+	    printf("Unsupported LSM manifest.\n");
+	    exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t i = 0; i < num_runs; i++) {
+	    uint8_t entry[LSM_MANIFEST_RUN_SIZE];
+	    if (pread(fd, entry, LSM_MANIFEST_RUN_SIZE, LSM_MANIFEST_HEADER_SIZE + i * LSM_MANIFEST_RUN_SIZE)
+		!= LSM_MANIFEST_RUN_SIZE) {
+		printf("Unable to read LSM manifest\n");
+		exit(EXIT_FAILURE);
+	    }
+	    uint64_t id;
+	    uint32_t level;
+	    memcpy(&id, entry, sizeof(uint64_t));
+	    memcpy(&level, entry + 8, sizeof(uint32_t));
+
+	    char suffix[32];
+	    snprintf(suffix, sizeof(suffix), ".r%" PRIu64, id);
+	    char *run_filename = temp_filename(filename, suffix);
+	    lsm->runs[lsm->num_runs] = lsm_run_open(run_filename, id, level);
+	    lsm->num_runs += 1;
+	    free(run_filename);
+	}
+	close(fd);
+    }
+
+    if (pthread_create(&(lsm->compactor), NULL, lsm_compaction_thread, lsm) != 0) {
+	printf("Unable to start compaction thread.\n");
+	exit(EXIT_FAILURE);
+    }
+
+    Table *table = malloc(sizeof(Table));
+    table->pager = NULL;
+    table->root_page_num = 0;
+    table->filename = strdup(filename);
+    table->has_last_leaf = false;
+    table->hash_index = NULL;
+    table->num_partitions = 0;
+    table->lsm = lsm;
+    return table;
+}
+
+/* memtable 没有日志，关闭时写成 run。正在进行的合并完成之后线程才退出 */
+void lsm_close(LsmTree *lsm) {
+    lsm_flush_memtable(lsm);
+
+    pthread_mutex_lock(&(lsm->mutex));
+    lsm->stopping = true;
+    pthread_cond_broadcast(&(lsm->changed));
+    pthread_mutex_unlock(&(lsm->mutex));
+    pthread_join(lsm->compactor, NULL);
+
+    for (uint32_t i = 0; i < lsm->num_runs; i++) {
+	lsm_run_unref(lsm->runs[i]);
+    }
+    pthread_mutex_destroy(&(lsm->mutex));
+    pthread_cond_destroy(&(lsm->changed));
+    free(lsm->memtable);
+    free(lsm->memtable_keys);
+    free(lsm->filename);
+    free(lsm);
+}
+
+ExecuteResult lsm_insert(LsmTree *lsm, Row *row) {
+    uint32_t key = row->id;
+    if (lsm_memtable_contains(lsm, key)) {
+	return EXECUTE_DUPLICATE_KEY;
+    }
+
+    /* 布隆过滤器排除绝大多数的 run，剩下的只需要读一个块 */
+    bool duplicate = false;
+    uint8_t *rows = malloc(PAGE_SIZE);
+    pthread_mutex_lock(&(lsm->mutex));
+    for (uint32_t i = 0; i < lsm->num_runs && !duplicate; i++) {
+	duplicate = lsm_run_contains(lsm->runs[i], key, rows);
+    }
+    pthread_mutex_unlock(&(lsm->mutex));
+    free(rows);
+    if (duplicate) {
+	return EXECUTE_DUPLICATE_KEY;
+    }
+
+    /* 追加到 memtable 的末尾，按 id 递增插入时 memtable 始终有序 */
+    void *value = lsm->memtable + (size_t)lsm->memtable_rows * ROW_SIZE;
+    if (lsm->memtable_rows > 0 && key < lsm_row_key(value - ROW_SIZE)) {
+	lsm->memtable_sorted = false;
+    }
+    serialize_row(row, value);
+    lsm->memtable_rows += 1;
+
+    uint32_t mask = 2 * LSM_MEMTABLE_ROWS - 1;
+    uint32_t slot = (key * 2654435761u) & mask;
+    while (lsm->memtable_keys[slot] != 0) {
+	slot = (slot + 1) & mask;
+    }
+    lsm->memtable_keys[slot] = key + 1;
+
+    if (lsm->memtable_rows == LSM_MEMTABLE_ROWS) {
+	lsm_flush_memtable(lsm);
+    }
+    return EXECUTE_SUCCESS;
+}
+
+/* 归并 memtable 和所有的 run，结果按 id 排序。扫描期间 run 可能被合并掉，
+ * 因此先持有每个 run 的引用。 */
+void lsm_scan(Statement *statement, LsmTree *lsm, RowSink *sink) {
+    Predicate *where = &(statement->where);
+    trace_phase(PHASE_SEEK);
+    lsm_sort_memtable(lsm);
+
+    LsmSource sources[LSM_MAX_RUNS + 1];
+    uint32_t num_sources = 0;
+    lsm_source_init(&(sources[num_sources++]), lsm, NULL);
+    pthread_mutex_lock(&(lsm->mutex));
+    for (uint32_t i = 0; i < lsm->num_runs; i++) {
+	lsm->runs[i]->refs += 1;
+	lsm_source_init(&(sources[num_sources++]), lsm, lsm->runs[i]);
+    }
+    pthread_mutex_unlock(&(lsm->mutex));
+
+    bool has_lower_bound = where->enabled && where->column == COLUMN_ID
+	&& (where->op == COMPARE_EQUAL || where->op == COMPARE_GREATER_EQUAL || where->op == COMPARE_GREATER);
+    for (uint32_t i = 0; i < num_sources; i++) {
+	LsmSource *source = &(sources[i]);
+	if (where->enabled && where->column == COLUMN_ID && where->op == COMPARE_EQUAL
+	    && source->run != NULL && !lsm_run_may_contain(source->run, where->id)) {
+	    source->position = source->num_rows;
+	} else if (has_lower_bound) {
+	    lsm_source_seek(source, where->id);
+	}
+    }
+
+    int32_t next;
+    while ((next = lsm_next_source(sources, num_sources)) != -1) {
+	trace_phase(PHASE_SCAN);
+	void *value = lsm_source_value(&(sources[next]));
+	if (active_trace) {
+	    active_trace->rows_examined += 1;
+	}
+
+	if (where->enabled) {
+	    if (predicate_exhausted(where, value)) {
+		break;
+	    }
+	    if (!predicate_match(where, value)) {
+		sources[next].position += 1;
+		continue;
+	    }
+	}
+
+	trace_phase(PHASE_OUTPUT);
+	if (!row_sink_emit(sink, value)) {
+	    break;
+	}
+	sources[next].position += 1;
+    }
+
+    pthread_mutex_lock(&(lsm->mutex));
+    for (uint32_t i = 1; i < num_sources; i++) {
+	free(sources[i].rows);
+	lsm_run_unref(sources[i].run);
+    }
+    pthread_mutex_unlock(&(lsm->mutex));
+}
+
+void lsm_print(LsmTree *lsm) {
+    pthread_mutex_lock(&(lsm->mutex));
+    printf("LSM: memtable %d rows, %d runs, %" PRIu64 " compactions\n",
+	   lsm->memtable_rows, lsm->num_runs, lsm->compactions);
+    for (uint32_t i = 0; i < lsm->num_runs; i++) {
+	LsmRun *run = lsm->runs[i];
+	printf("  L%d run %" PRIu64 ": %" PRIu64 " rows in %" PRIu64 " blocks, ids %d..%d\n",
+	       run->level, run->id, run->num_rows, run->num_blocks, run->min_key, run->max_key);
+    }
+    pthread_mutex_unlock(&(lsm->mutex));
+}
+
+uint32_t lsm_row_key(void *row) {
+    uint32_t key;
+    memcpy(&key, row + ID_OFFSET, ID_SIZE);
+    return key;
+}
+
+bool lsm_memtable_contains(LsmTree *lsm, uint32_t key) {
+    uint32_t mask = 2 * LSM_MEMTABLE_ROWS - 1;
+    uint32_t slot = (key * 2654435761u) & mask;
+    while (lsm->memtable_keys[slot] != 0) {
+	if (lsm->memtable_keys[slot] == key + 1) {
+	    return true;
+	}
+	slot = (slot + 1) & mask;
+    }
+    return false;
+}
+
+int lsm_compare_rows(const void *a, const void *b) {
+    uint32_t key_a = lsm_row_key((void *)a);
+    uint32_t key_b = lsm_row_key((void *)b);
+    return key_a < key_b ? -1 : key_a > key_b;
+}
+
+void lsm_sort_memtable(LsmTree *lsm) {
+    if (!(lsm->memtable_sorted)) {
+	qsort(lsm->memtable, lsm->memtable_rows, ROW_SIZE, lsm_compare_rows);
+	lsm->memtable_sorted = true;
+    }
+}
 
-    /* 将 root 节点的数据复制给做节点 */
-    memcpy(left_child, root, PAGE_SIZE);
-    set_node_root(left_child, false);
+/* 将 memtable 顺序写成一个 L0 的 run */
+void lsm_flush_memtable(LsmTree *lsm) {
+    if (lsm->memtable_rows == 0) {
+	return;
+    }
 
-    /* root 节点是一个只有一个键和两个孩子的节点 */
-    initialize_internal_node(root);
-    set_node_root(root, true);
-    *internal_node_num_keys(root) = 1;
-    *internal_node_child(root, 0) = left_child_page_num;
-    uint32_t left_child_max_key = get_node_max_key(left_child);
-    *internal_node_key(root, 0) = left_child_max_key;
-    *internal_node_right_child(root) = right_child_page_num;
+    lsm_sort_memtable(lsm);
+    LsmRunWriter writer;
+    lsm_run_writer_open(&writer, lsm, 0, lsm->memtable_rows);
+    for (uint32_t i = 0; i < lsm->memtable_rows; i++) {
+	lsm_run_writer_append(&writer, lsm->memtable + (size_t)i * ROW_SIZE);
+    }
+    LsmRun *run = lsm_run_writer_finish(&writer);
+
+    /* 合并跟不上、L0 的 run 达到 LSM_L0_STALL_RUNS 时等待，L0 的 run 之间重叠，太多会让查询变慢 */
+    pthread_mutex_lock(&(lsm->mutex));
+    while (lsm_level0_runs(lsm) >= LSM_L0_STALL_RUNS || lsm->num_runs >= LSM_MAX_RUNS) {
+	pthread_cond_wait(&(lsm->changed), &(lsm->mutex));
+    }
+    lsm_add_run(lsm, run);
+    lsm_write_manifest(lsm);
+    pthread_cond_broadcast(&(lsm->changed));
+    pthread_mutex_unlock(&(lsm->mutex));
+
+    lsm->memtable_rows = 0;
+    lsm->memtable_sorted = true;
+    memset(lsm->memtable_keys, 0, 2 * LSM_MEMTABLE_ROWS * sizeof(uint32_t));
 }
 
-uint32_t *internal_node_num_keys(void *node) {
-    return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+/* runs 按层排列，L0 的 run 都在最前面。调用者持有 mutex */
+uint32_t lsm_level0_runs(LsmTree *lsm) {
+    uint32_t num_l0 = 0;
+    while (num_l0 < lsm->num_runs && lsm->runs[num_l0]->level == 0) {
+	num_l0 += 1;
+    }
+    return num_l0;
 }
 
-uint32_t *internal_node_right_child(void *node) {
-    return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+/* 保持 runs 按层排列，同一层中新的在前。调用者持有 mutex */
+void lsm_add_run(LsmTree *lsm, LsmRun *run) {
+    uint32_t i = lsm->num_runs;
+    while (i > 0 && (lsm->runs[i - 1]->level > run->level
+		     || (lsm->runs[i - 1]->level == run->level && lsm->runs[i - 1]->id < run->id))) {
+	lsm->runs[i] = lsm->runs[i - 1];
+	i -= 1;
+    }
+    lsm->runs[i] = run;
+    lsm->num_runs += 1;
 }
 
-uint32_t *internal_node_cell(void *node, uint32_t cell_num) {
-    return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+/* 先写临时文件再 rename，清单的替换是原子的。调用者持有 mutex */
+void lsm_write_manifest(LsmTree *lsm) {
+    char *manifest_filename = temp_filename(lsm->filename, ".manifest");
+    int fd = open(manifest_filename, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (fd == -1) {
+	printf("Unable to open file\n");
+	exit(EXIT_FAILURE);
+    }
+
+    size_t size = LSM_MANIFEST_HEADER_SIZE + lsm->num_runs * LSM_MANIFEST_RUN_SIZE;
+    uint8_t *manifest = calloc(1, size);
+    uint32_t version = LSM_FORMAT_VERSION;
+    memcpy(manifest, LSM_FILE_MAGIC, 8);
+    memcpy(manifest + 8, &version, sizeof(uint32_t));
+    memcpy(manifest + 12, &(lsm->num_runs), sizeof(uint32_t));
+    memcpy(manifest + 16, &(lsm->next_run_id), sizeof(uint64_t));
+    for (uint32_t i = 0; i < lsm->num_runs; i++) {
+	uint8_t *entry = manifest + LSM_MANIFEST_HEADER_SIZE + i * LSM_MANIFEST_RUN_SIZE;
+	memcpy(entry, &(lsm->runs[i]->id), sizeof(uint64_t));
+	memcpy(entry + 8, &(lsm->runs[i]->level), sizeof(uint32_t));
+    }
+
+    if (pwrite(fd, manifest, size, 0) != (ssize_t)size || fsync(fd) == -1) {
+	printf("Error writing: %d\n", errno);
+	exit(EXIT_FAILURE);
+    }
+    close(fd);
+    free(manifest);
+
+    if (rename(manifest_filename, lsm->filename) == -1) {
+	printf("Error replacing db file: %d\n", errno);
+	exit(EXIT_FAILURE);
+    }
+    free(manifest_filename);
 }
 
-uint32_t *internal_node_child(void *node, uint32_t child_num) {
-    uint32_t num_keys = *internal_node_num_keys(node);
-    if (child_num > num_keys) {
-        printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
+/* 后台合并线程。合并时不持有 mutex，输入的 run 不会被修改，只需要持有它们的引用 */
+void *lsm_compaction_thread(void *argument) {
+    LsmTree *lsm = argument;
+    LsmRun *inputs[LSM_MAX_RUNS];
+
+    pthread_mutex_lock(&(lsm->mutex));
+    while (!(lsm->stopping)) {
+	uint32_t level;
+	uint32_t num_inputs = lsm_pick_compaction(lsm, inputs, &level);
+	if (num_inputs == 0) {
+	    pthread_cond_wait(&(lsm->changed), &(lsm->mutex));
+	    continue;
+	}
+	for (uint32_t i = 0; i < num_inputs; i++) {
+	    inputs[i]->refs += 1;
+	}
+	pthread_mutex_unlock(&(lsm->mutex));
+
+	LsmRun *output = lsm_merge_runs(lsm, inputs, num_inputs, level);
+
+	/* 用合并的结果替换输入，清单写入之后旧的 run 才能删除 */
+	pthread_mutex_lock(&(lsm->mutex));
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < lsm->num_runs; i++) {
+	    bool is_input = false;
+	    for (uint32_t j = 0; j < num_inputs; j++) {
+		is_input = is_input || lsm->runs[i] == inputs[j];
+	    }
+	    if (!is_input) {
+		lsm->runs[kept++] = lsm->runs[i];
+	    }
+	}
+	lsm->num_runs = kept;
+	lsm_add_run(lsm, output);
+	lsm_write_manifest(lsm);
+	for (uint32_t i = 0; i < num_inputs; i++) {
+	    inputs[i]->obsolete = true;
+	    // 一个是清单的引用，一个是合并时持有的引用
+	    lsm_run_unref(inputs[i]);
+	    lsm_run_unref(inputs[i]);
+	}
+	lsm->compactions += 1;
+	pthread_cond_broadcast(&(lsm->changed));
+    }
+    pthread_mutex_unlock(&(lsm->mutex));
+
+    return NULL;
+}
+
+/* 选出需要合并的 run，返回个数，没有需要合并的返回 0。调用者持有 mutex */
+uint32_t lsm_pick_compaction(LsmTree *lsm, LsmRun **inputs, uint32_t *target_level) {
+    uint32_t num_l0 = lsm_level0_runs(lsm);
+
+    /* L0 的 run 之间可能重叠，全部和 L1 合并 */
+    if (num_l0 >= LSM_L0_MAX_RUNS) {
+	uint32_t num_inputs = num_l0;
+	memcpy(inputs, lsm->runs, num_l0 * sizeof(LsmRun *));
+	if (num_l0 < lsm->num_runs && lsm->runs[num_l0]->level == 1) {
+	    inputs[num_inputs++] = lsm->runs[num_l0];
+	}
+	*target_level = 1;
+	return num_inputs;
+    }
+
+    /* 每层的上限是上一层的 LSM_LEVEL_RATIO 倍 */
+    for (uint32_t i = num_l0; i < lsm->num_runs; i++) {
+	LsmRun *run = lsm->runs[i];
+	uint64_t max_rows = LSM_LEVEL_BASE_ROWS;
+	for (uint32_t level = 1; level < run->level; level++) {
+	    max_rows *= LSM_LEVEL_RATIO;
+	}
+	if (run->num_rows > max_rows && run->level + 1 < LSM_MAX_LEVELS) {
+	    uint32_t num_inputs = 0;
+	    inputs[num_inputs++] = run;
+	    if (i + 1 < lsm->num_runs && lsm->runs[i + 1]->level == run->level + 1) {
+		inputs[num_inputs++] = lsm->runs[i + 1];
+	    }
+	    *target_level = run->level + 1;
+	    return num_inputs;
+	}
+    }
+    return 0;
+}
+
+/* 归并若干个 run，顺序写成 level 层的一个新的 run */
+LsmRun *lsm_merge_runs(LsmTree *lsm, LsmRun **inputs, uint32_t num_inputs, uint32_t level) {
+    LsmSource sources[LSM_MAX_RUNS];
+    uint64_t num_rows = 0;
+    for (uint32_t i = 0; i < num_inputs; i++) {
+	lsm_source_init(&(sources[i]), lsm, inputs[i]);
+	num_rows += inputs[i]->num_rows;
+    }
+
+    LsmRunWriter writer;
+    lsm_run_writer_open(&writer, lsm, level, num_rows);
+    int32_t next;
+    while ((next = lsm_next_source(sources, num_inputs)) != -1) {
+	lsm_run_writer_append(&writer, lsm_source_value(&(sources[next])));
+	sources[next].position += 1;
+    }
+
+    for (uint32_t i = 0; i < num_inputs; i++) {
+	free(sources[i].rows);
+    }
+    return lsm_run_writer_finish(&writer);
+}
+
+LsmRun *lsm_run_open(const char *filename, uint64_t id, uint32_t level) {
+    int fd = open(filename, O_RDONLY);
+    uint8_t header[48];
+    if (fd == -1 || pread(fd, header, sizeof(header), 0) != sizeof(header)
+	|| memcmp(header, LSM_RUN_MAGIC, 8) != 0) {
+	printf("Unable to read LSM run '%s'\n", filename);
 	exit(EXIT_FAILURE);
     }
-    if (child_num == num_keys) {
-        return internal_node_right_child(node);
+
+    LsmRun *run = malloc(sizeof(LsmRun));
+    uint64_t bloom_bytes;
+    run->id = id;
+    run->level = level;
+    run->filename = strdup(filename);
+    run->file_descriptor = fd;
+    memcpy(&(run->rows_per_block), header + LSM_RUN_ROWS_PER_BLOCK_OFFSET, sizeof(uint32_t));
+    memcpy(&(run->num_rows), header + LSM_RUN_NUM_ROWS_OFFSET, sizeof(uint64_t));
+    memcpy(&(run->num_blocks), header + LSM_RUN_NUM_BLOCKS_OFFSET, sizeof(uint64_t));
+    memcpy(&bloom_bytes, header + LSM_RUN_BLOOM_BYTES_OFFSET, sizeof(uint64_t));
+    memcpy(&(run->min_key), header + LSM_RUN_MIN_KEY_OFFSET, sizeof(uint32_t));
+    memcpy(&(run->max_key), header + LSM_RUN_MAX_KEY_OFFSET, sizeof(uint32_t));
+    if (run->rows_per_block != PAGE_SIZE / ROW_SIZE) {
+	printf("Unsupported LSM run '%s'\n", filename);
+	exit(EXIT_FAILURE);
     }
 
-    return internal_node_cell(node, child_num);
+    /* 稀疏索引和布隆过滤器紧跟在数据块之后 */
+    off_t index_offset = (off_t)(run->num_blocks + 1) * PAGE_SIZE;
+    ssize_t index_size = run->num_blocks * sizeof(uint32_t);
+    run->block_keys = malloc(index_size);
+    run->bloom = malloc(bloom_bytes);
+    run->bloom_bits = bloom_bytes * 8;
+    if (pread(fd, run->block_keys, index_size, index_offset) != index_size
+	|| pread(fd, run->bloom, bloom_bytes, index_offset + index_size) != (ssize_t)bloom_bytes) {
+	printf("Unable to read LSM run '%s'\n", filename);
+	exit(EXIT_FAILURE);
+    }
+
+    run->refs = 1;
+    run->obsolete = false;
+    return run;
 }
 
+/* 引用为 0 时关闭文件，已经被合并掉的 run 同时删除文件 */
+void lsm_run_unref(LsmRun *run) {
+    run->refs -= 1;
+    if (run->refs > 0) {
+	return;
+    }
 
-uint32_t *internal_node_key(void *node, uint32_t key_num) {
-    return internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+    close(run->file_descriptor);
+    if (run->obsolete) {
+	unlink(run->filename);
+    }
+    free(run->filename);
+    free(run->block_keys);
+    free(run->bloom);
+    free(run);
 }
 
-uint32_t get_node_max_key(void *node) {
-    switch (get_node_type(node)) {
-        case NODE_INTERNAL:
-	    return *internal_node_key(node, *internal_node_num_keys(node) - 1);
-	case NODE_LEAF:
-	    return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+/* 读取一个数据块，返回其中记录的条数 */
+uint32_t lsm_run_read_block(LsmRun *run, uint64_t block, uint8_t *rows) {
+    ssize_t bytes_read = pread(run->file_descriptor, rows, PAGE_SIZE, (off_t)(block + 1) * PAGE_SIZE);
+    if (bytes_read != PAGE_SIZE) {
+	printf("Error reading file: %d\n", errno);
+	exit(EXIT_FAILURE);
+    }
+    if (active_trace) {
+	active_trace->read_calls += 1;
+	active_trace->pages_read += 1;
     }
+
+    uint64_t remaining = run->num_rows - block * run->rows_per_block;
+    return remaining < run->rows_per_block ? remaining : run->rows_per_block;
 }
 
-bool is_node_root(void *node) {
-    uint8_t value = *((uint8_t*) (node + IS_ROOT_OFFSET));
-    return (bool)value;
+/* 返回可能包含 key 的块，即第一条记录的 id 不大于 key 的最后一个块 */
+uint64_t lsm_run_find_block(LsmRun *run, uint32_t key) {
+    uint64_t min_index = 0;
+    uint64_t max_index = run->num_blocks - 1;
+    while (min_index < max_index) {
+	uint64_t index = (min_index + max_index + 1) / 2;
+	if (run->block_keys[index] <= key) {
+	    min_index = index;
+	} else {
+	    max_index = index - 1;
+	}
+    }
+    return min_index;
 }
 
-void set_node_root(void *node, bool is_root) {
-    uint8_t value = is_root;
-    *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
+bool lsm_run_may_contain(LsmRun *run, uint32_t key) {
+    if (key < run->min_key || key > run->max_key) {
+	return false;
+    }
+    for (uint32_t i = 0; i < LSM_BLOOM_HASHES; i++) {
+	uint64_t bit = lsm_bloom_hash(key, i) % run->bloom_bits;
+	if (!(run->bloom[bit / 8] & (1 << (bit % 8)))) {
+	    return false;
+	}
+    }
+    return true;
 }
 
-void initialize_internal_node(void *node) {
-    set_node_type(node, NODE_INTERNAL);
-    set_node_root(node, false);
-    *internal_node_num_keys(node) = 0;
+bool lsm_run_contains(LsmRun *run, uint32_t key, uint8_t *rows) {
+    if (!lsm_run_may_contain(run, key)) {
+	return false;
+    }
+
+    uint32_t num_rows = lsm_run_read_block(run, lsm_run_find_block(run, key), rows);
+    uint32_t min_index = 0;
+    uint32_t one_past_max_index = num_rows;
+    while (one_past_max_index != min_index) {
+	uint32_t index = (min_index + one_past_max_index) / 2;
+	uint32_t key_at_index = lsm_row_key(rows + (size_t)index * ROW_SIZE);
+	if (key == key_at_index) {
+	    return true;
+	}
+	if (key < key_at_index) {
+	    one_past_max_index = index;
+	} else {
+	    min_index = index + 1;
+	}
+    }
+    return false;
 }
 
-void indent(uint32_t level) {
-    for (uint32_t i = 0; i < level; i++) {
-        printf("  ");
+/* 两个哈希函数组合出第 i 个哈希值 */
+uint64_t lsm_bloom_hash(uint32_t key, uint32_t i) {
+    uint64_t h1 = (uint64_t)key * 0x9E3779B97F4A7C15ULL;
+    uint64_t h2 = ((uint64_t)key * 0xC2B2AE3D27D4EB4FULL) | 1;
+    h1 ^= h1 >> 29;
+    h2 ^= h2 >> 32;
+    return h1 + i * h2;
+}
+
+void lsm_run_writer_open(LsmRunWriter *writer, LsmTree *lsm, uint32_t level, uint64_t expected_rows) {
+    pthread_mutex_lock(&(lsm->mutex));
+    writer->id = lsm->next_run_id;
+    lsm->next_run_id += 1;
+    pthread_mutex_unlock(&(lsm->mutex));
+
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".r%" PRIu64, writer->id);
+    writer->lsm = lsm;
+    writer->level = level;
+    writer->filename = temp_filename(lsm->filename, suffix);
+    int fd = open(writer->filename, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    writer->stream = fd == -1 ? NULL : fdopen(fd, "w");
+    if (writer->stream == NULL) {
+	printf("Unable to open file\n");
+	exit(EXIT_FAILURE);
     }
+    setvbuf(writer->stream, NULL, _IOFBF, LSM_WRITE_BUFFER_SIZE);
+
+    writer->rows_per_block = PAGE_SIZE / ROW_SIZE;
+    writer->num_rows = 0;
+    writer->block = calloc(1, PAGE_SIZE);
+    writer->block_rows = 0;
+    writer->block_keys = malloc((expected_rows / writer->rows_per_block + 1) * sizeof(uint32_t));
+    writer->num_blocks = 0;
+    writer->bloom_bits = (expected_rows * LSM_BLOOM_BITS_PER_KEY + 64) / 64 * 64;
+    writer->bloom = calloc(1, writer->bloom_bits / 8);
+    writer->min_key = 0;
+    writer->max_key = 0;
+
+    /* 文件头最后再写，先占住 0 号页面 */
+    fwrite(writer->block, 1, PAGE_SIZE, writer->stream);
 }
 
-void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level) {
-    void *node = get_page(pager, page_num);
-    uint32_t num_keys, child;
+void lsm_run_writer_append(LsmRunWriter *writer, void *row) {
+    uint32_t key = lsm_row_key(row);
+    if (writer->num_rows == 0) {
+	writer->min_key = key;
+    }
+    writer->max_key = key;
+    if (writer->block_rows == 0) {
+	writer->block_keys[writer->num_blocks] = key;
+    }
+    for (uint32_t i = 0; i < LSM_BLOOM_HASHES; i++) {
+	uint64_t bit = lsm_bloom_hash(key, i) % writer->bloom_bits;
+	writer->bloom[bit / 8] |= 1 << (bit % 8);
+    }
 
-    switch (get_node_type(node)) {
-        case (NODE_LEAF):
-	    num_keys = *leaf_node_num_cells(node);
-	    indent(indentation_level);
-	    printf("- leaf (size %d)\n", num_keys);
-	    for (uint32_t i = 0; i < num_keys; i++) {
-	        indent(indentation_level + 1);
-		printf("- %d\n", *leaf_node_key(node, i));
-	    }
-	    break;
-	case (NODE_INTERNAL):
-	    num_keys = *internal_node_num_keys(node);
-	    indent(indentation_level);
-	    printf("- internal (size %d)\n", num_keys);
-	    for (uint32_t i = 0; i < num_keys; i++) {
-	        child = *internal_node_child(node, i);
-		print_tree(pager, child, indentation_level + 1);
+    memcpy(writer->block + (size_t)writer->block_rows * ROW_SIZE, row, ROW_SIZE);
+    writer->block_rows += 1;
+    writer->num_rows += 1;
+    if (writer->block_rows == writer->rows_per_block) {
+	lsm_run_writer_flush_block(writer);
+    }
+}
 
-		indent(indentation_level);
-		printf("- key %d\n", *internal_node_key(node, i));
+void lsm_run_writer_flush_block(LsmRunWriter *writer) {
+    if (writer->block_rows == 0) {
+	return;
+    }
+    fwrite(writer->block, 1, PAGE_SIZE, writer->stream);
+    memset(writer->block, 0, PAGE_SIZE);
+    writer->block_rows = 0;
+    writer->num_blocks += 1;
+}
+
+/* 写入稀疏索引、布隆过滤器和文件头，落盘之后打开这个 run */
+LsmRun *lsm_run_writer_finish(LsmRunWriter *writer) {
+    lsm_run_writer_flush_block(writer);
+    uint64_t bloom_bytes = writer->bloom_bits / 8;
+    fwrite(writer->block_keys, sizeof(uint32_t), writer->num_blocks, writer->stream);
+    fwrite(writer->bloom, 1, bloom_bytes, writer->stream);
+
+    uint8_t header[48];
+    uint32_t version = LSM_FORMAT_VERSION;
+    memcpy(header, LSM_RUN_MAGIC, 8);
+    memcpy(header + 8, &version, sizeof(uint32_t));
+    memcpy(header + LSM_RUN_ROWS_PER_BLOCK_OFFSET, &(writer->rows_per_block), sizeof(uint32_t));
+    memcpy(header + LSM_RUN_NUM_ROWS_OFFSET, &(writer->num_rows), sizeof(uint64_t));
+    memcpy(header + LSM_RUN_NUM_BLOCKS_OFFSET, &(writer->num_blocks), sizeof(uint64_t));
+    memcpy(header + LSM_RUN_BLOOM_BYTES_OFFSET, &bloom_bytes, sizeof(uint64_t));
+    memcpy(header + LSM_RUN_MIN_KEY_OFFSET, &(writer->min_key), sizeof(uint32_t));
+    memcpy(header + LSM_RUN_MAX_KEY_OFFSET, &(writer->max_key), sizeof(uint32_t));
+    fseek(writer->stream, 0, SEEK_SET);
+    fwrite(header, 1, sizeof(header), writer->stream);
+
+    if (fflush(writer->stream) != 0 || fsync(fileno(writer->stream)) == -1) {
+	printf("Error writing: %d\n", errno);
+	exit(EXIT_FAILURE);
+    }
+    fclose(writer->stream);
+
+    LsmRun *run = lsm_run_open(writer->filename, writer->id, writer->level);
+    free(writer->filename);
+    free(writer->block);
+    free(writer->block_keys);
+    free(writer->bloom);
+    return run;
+}
+
+void lsm_source_init(LsmSource *source, LsmTree *lsm, LsmRun *run) {
+    source->run = run;
+    source->position = 0;
+    source->loaded_block = UINT64_MAX;
+    if (run == NULL) {
+	source->rows = lsm->memtable;
+	source->num_rows = lsm->memtable_rows;
+    } else {
+	source->rows = malloc(PAGE_SIZE);
+	source->num_rows = run->num_rows;
+    }
+}
+
+/* 当前记录，所在的块不在内存中时先读入 */
+void *lsm_source_value(LsmSource *source) {
+    if (source->run == NULL) {
+	return source->rows + (size_t)source->position * ROW_SIZE;
+    }
+
+    uint64_t block = source->position / source->run->rows_per_block;
+    if (block != source->loaded_block) {
+	lsm_run_read_block(source->run, block, source->rows);
+	source->loaded_block = block;
+    }
+    return source->rows + (size_t)(source->position % source->run->rows_per_block) * ROW_SIZE;
+}
+
+/* 定位到第一条 id 不小于 key 的记录 */
+void lsm_source_seek(LsmSource *source, uint32_t key) {
+    uint64_t min_index = 0;
+    uint64_t one_past_max_index = source->num_rows;
+    if (source->run != NULL && source->num_rows > 0) {
+	uint64_t block = lsm_run_find_block(source->run, key);
+	min_index = block * source->run->rows_per_block;
+	one_past_max_index = min_index + source->run->rows_per_block;
+	if (one_past_max_index > source->num_rows) {
+	    one_past_max_index = source->num_rows;
+	}
+    }
+
+    while (one_past_max_index != min_index) {
+	source->position = (min_index + one_past_max_index) / 2;
+	if (lsm_row_key(lsm_source_value(source)) < key) {
+	    min_index = source->position + 1;
+	} else {
+	    one_past_max_index = source->position;
+	}
+    }
+    source->position = min_index;
+}
+
+/* 返回当前记录的 id 最小的来源，全部读完时返回 -1 */
+int32_t lsm_next_source(LsmSource *sources, uint32_t num_sources) {
+    int32_t next = -1;
+    uint32_t next_key = 0;
+    for (uint32_t i = 0; i < num_sources; i++) {
+	if (sources[i].position >= sources[i].num_rows) {
+	    continue;
+	}
+	uint32_t key = lsm_row_key(lsm_source_value(&(sources[i])));
+	if (next == -1 || key < next_key) {
+	    next = i;
+	    next_key = key;
+	}
+    }
+    return next;
+}
+
+HashIndex *hash_index_new(uint32_t max_entries) {
+    HashIndex *index = malloc(sizeof(HashIndex));
+    index->max_entries = max_entries;
+    /* 用 64 位计算容量，max_entries 很大时乘 2 不会溢出 */
+    uint64_t capacity = 1;
+    while (capacity < (uint64_t)max_entries * 2) {
+	capacity *= 2;
+    }
+    index->entries = capacity <= UINT32_MAX ? malloc(capacity * sizeof(HashIndexEntry)) : NULL;
+    if (index->entries == NULL) {
+	printf("Unable to allocate hash index of %" PRIu32 " entries.\n", max_entries);
+	exit(EXIT_FAILURE);
+    }
+    index->capacity = capacity;
+    memset(index->page_versions, 0, sizeof(index->page_versions));
+    hash_index_reset(index);
+    return index;
+}
+
+void hash_index_free(HashIndex *index) {
+    if (index == NULL) {
+	return;
+    }
+    free(index->entries);
+    free(index);
+}
+
+/* 清空所有的项和统计，页面的版本保持不变 */
+void hash_index_reset(HashIndex *index) {
+    memset(index->entries, 0, index->capacity * sizeof(HashIndexEntry));
+    memset(index->lookups, 0, sizeof(index->lookups));
+    memset(index->page_indexed, 0, sizeof(index->page_indexed));
+    index->num_entries = 0;
+    index->hits = 0;
+    index->misses = 0;
+}
+
+/* 命中时返回指向 key 的游标，否则返回 NULL */
+Cursor *hash_index_find(Table *table, uint32_t key) {
+    HashIndex *index = table->hash_index;
+    if (index == NULL) {
+	return NULL;
+    }
+
+    uint32_t slot = (key * 2654435761u) & (index->capacity - 1);
+    while (index->entries[slot].used) {
+	HashIndexEntry *entry = &(index->entries[slot]);
+	if (entry->key == key) {
+	    if (entry->page_version != index->page_versions[entry->page_num]) {
+	        break;
+	    }
+	    index->hits += 1;
+	    if (active_trace) {
+	        active_trace->hash_index_hits += 1;
 	    }
 
-	    child = *internal_node_right_child(node);
-	    print_tree(pager, child, indentation_level + 1);
-	    break;
+	    Cursor *cursor = malloc(sizeof(Cursor));
+	    cursor->table = table;
+	    cursor->page_num = entry->page_num;
+	    cursor->cell_num = entry->cell_num;
+	    cursor->end_of_table = false;
+	    return cursor;
+	}
+	slot = (slot + 1) & (index->capacity - 1);
     }
+
+    index->misses += 1;
+    return NULL;
 }
 
+/* 叶子被点查的次数达到阈值后，把它的所有键加入索引 */
+void hash_index_note_lookup(Table *table, uint64_t page_num) {
+    HashIndex *index = table->hash_index;
+    if (index == NULL || page_num >= TABLE_MAX_PAGES || index->page_indexed[page_num]) {
+	return;
+    }
 
-Cursor *internal_node_find(Table *table, uint32_t page_num, uint32_t key) {
-    void *node = get_page(table->pager, page_num);
-    uint32_t num_keys = *internal_node_num_keys(node);
+    index->lookups[page_num] += 1;
+    if (index->lookups[page_num] >= HASH_INDEX_HOT_LOOKUPS) {
+	hash_index_add_leaf(index, get_page(table->pager, page_num), page_num);
+    }
+}
 
-    /* Binary search to find index of child to search */
-    uint32_t min_index = 0;
-    uint32_t max_index = num_keys;
+void hash_index_add_leaf(HashIndex *index, void *node, uint64_t page_num) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (num_cells > index->max_entries) {
+	return;
+    }
+    /* 容量用完时清空索引，之后重新统计哪些叶子是热点 */
+    if (index->num_entries + num_cells > index->max_entries) {
+	hash_index_reset(index);
+    }
 
-    while (min_index != max_index) {
-        uint32_t index = (min_index + max_index) / 2;
-        uint32_t key_to_right = *internal_node_key(node, index);
-        if (key_to_right >= key) {
-            max_index = index;
-        } else {
-            min_index = index + 1;
-        }
+    for (uint32_t i = 0; i < num_cells; i++) {
+	uint32_t key = *leaf_node_key(node, i);
+	uint32_t slot = (key * 2654435761u) & (index->capacity - 1);
+	while (index->entries[slot].used && index->entries[slot].key != key) {
+	    slot = (slot + 1) & (index->capacity - 1);
+	}
+
+	HashIndexEntry *entry = &(index->entries[slot]);
+	if (!entry->used) {
+	    entry->used = true;
+	    index->num_entries += 1;
+	}
+	entry->key = key;
+	entry->cell_num = i;
+	entry->page_num = page_num;
+	entry->page_version = index->page_versions[page_num];
     }
-    uint32_t child_num = *internal_node_child(node, min_index);
-    void *child = get_page(table->pager, child_num);
-    switch (get_node_type(child)) {
-        case NODE_LEAF:
-	    return leaf_node_find(table, child_num, key);
+    index->page_indexed[page_num] = true;
+}
+
+/* 叶子中的 cell 发生移动之后，索引中指向这个叶子的项全部失效 */
+void hash_index_invalidate(Table *table, uint64_t page_num) {
+    HashIndex *index = table->hash_index;
+    if (index == NULL || page_num >= TABLE_MAX_PAGES) {
+	return;
     }
 
+    index->page_versions[page_num] += 1;
+    index->page_indexed[page_num] = false;
+    index->lookups[page_num] = 0;
 }
 
-uint32_t* leaf_node_next_leaf(void *node) {
-    return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+double elapsed_ms(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/* 结束当前阶段的计时，并开始统计下一个阶段 */
+void trace_phase(QueryPhase phase) {
+    if (active_trace == NULL) {
+	return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (active_trace->phase != PHASE_NONE) {
+	active_trace->phase_ms[active_trace->phase] += elapsed_ms(&active_trace->phase_start, &now);
+    }
+    active_trace->phase = phase;
+    active_trace->phase_start = now;
+}
+
+/* 记录语句访问过的页面，同一个页面只记一次 */
+void trace_page(uint64_t page_num, bool cache_miss) {
+    if (page_num > TABLE_MAX_PAGES || active_trace->page_touched[page_num]) {
+	return;
+    }
+
+    active_trace->page_touched[page_num] = true;
+    active_trace->pages_touched += 1;
+    if (cache_miss) {
+	active_trace->page_missed[page_num] = true;
+	active_trace->cache_misses += 1;
+    }
+}
+
+/* 记录一条语句的执行轨迹并输出 */
+ExecuteResult execute_explain(Statement *statement, Table *table) {
+    QueryTrace trace;
+    memset(&trace, 0, sizeof(QueryTrace));
+    trace.phase = PHASE_NONE;
+    trace.phase_ms[PHASE_PARSE] = statement->parse_ms;
+
+    active_trace = &trace;
+    ExecuteResult result = execute_statement(statement, table);
+    trace_phase(PHASE_NONE);
+    active_trace = NULL;
+
+    print_trace(&trace);
+    return result;
+}
+
+void print_trace(QueryTrace *trace) {
+    printf("Explain analyze:\n");
+    printf("  pages touched: %d (cache misses: %d)\n", trace->pages_touched, trace->cache_misses);
+    printf("  pages:");
+    for (uint32_t i = 0; i <= TABLE_MAX_PAGES; i++) {
+	if (trace->page_touched[i]) {
+	    printf(" %d%s", i, trace->page_missed[i] ? "*" : "");
+	}
+    }
+    printf("  (* = cache miss)\n");
+    printf("  nodes visited: %d\n", trace->nodes_visited);
+    printf("  leaves walked: %d\n", trace->leaves_walked);
+    printf("  rows examined: %d, returned: %d\n", trace->rows_examined, trace->rows_returned);
+    printf("  splits: %d\n", trace->splits);
+    printf("  reads: %d calls, %d pages\n", trace->read_calls, trace->pages_read);
+    printf("  hash index hits: %d\n", trace->hash_index_hits);
+    printf("  sort runs spilled: %d\n", trace->sort_runs);
+    printf("  sort merge passes: %d\n", trace->sort_merge_passes);
+
+    double total = 0;
+    for (uint32_t i = PHASE_PARSE; i < PHASE_COUNT; i++) {
+	total += trace->phase_ms[i];
+    }
+    printf("  time (ms): parse %.3f, seek %.3f, scan %.3f, output %.3f, total %.3f\n",
+	   trace->phase_ms[PHASE_PARSE], trace->phase_ms[PHASE_SEEK],
+	   trace->phase_ms[PHASE_SCAN], trace->phase_ms[PHASE_OUTPUT], total);
 }